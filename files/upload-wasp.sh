@@ -159,14 +159,6 @@ EOF
   fi
 }
 
-build_config() {
-  if [ -e "${WASP}/config.tar.gz" ] ; then
-    rm "${WASP}/config.tar.gz"
-  fi
-  cd "${WASP}/files"
-  find . -type f | xargs tar zcf "${WASP}/config.tar.gz"
-}
-
 reset_wasp() {
   echo 0 > /sys/class/gpio/fritz${MODEL}\:wasp\:reset/value
   sleep 1
@@ -174,11 +166,9 @@ reset_wasp() {
   sleep 1
 }
 
-if [ ! -e "${WASP}/config.tar.gz" ]; then
-  extract_eeprom
-  check_config
-  build_config
-fi
+# Only creates what is missing, the uploader packs the tree on the fly
+extract_eeprom
+check_config
 
 if [ ! -e "${WASP}/ath_tgt_fw1.fw" ]; then
   echo "${WASP}/ath_tgt_fw1.fw not found. Please extract it from AVM firmware and place it in ${WASP}"
@@ -193,16 +183,14 @@ fi
 reset_wasp
 n=0
 until [ $n -ge 5 ]; do
-  wasp_uploader_stage1 -f "${WASP}/ath_tgt_fw1.fw" -i eth0 -m ${MODEL} && break
+  # Promiscuous (-x) as before, in case the WASP does not address eth0.1
+  wasp_uploader -m ${MODEL} -i eth0 -f "${WASP}/ath_tgt_fw1.fw" \
+    -I eth0.1 -F "${WASP}/openwrt-ath79-generic-avm_fritzbox-${MODEL}-wasp-initramfs-kernel.bin" \
+    -c "${WASP}/files" -k "${WASP}/config.cache" -x && break
   n=$[$n+1]
+  reset_wasp
 done
 if [ $n -ge 5 ]; then
-  echo "Error uploading stage 1 firmware"
+  echo "Error uploading WASP firmware"
   exit 1
 fi
-
-n=0
-until [ $n -ge 5 ]; do
-  wasp_uploader_stage2 -f "${WASP}/openwrt-ath79-generic-avm_fritzbox-${MODEL}-wasp-initramfs-kernel.bin" -i eth0.1 -c "${WASP}/config.tar.gz" && break
-  n=$[$n+1]
-done
@@ -0,0 +1,188 @@
+/*
+ * libwasp: the AVM WASP upload protocols as non-blocking state machines
+ *
+ * The library does no I/O and never sleeps. The caller owns the MDIO
+ * bus, the socket and the clock: it feeds in what happened (a register
+ * read, a finished write, a received frame, an expired timer) together
+ * with the current CLOCK_MONOTONIC time in nanoseconds, and gets back
+ * the next thing to do and the time to do it at. That way a resident
+ * service can drive any number of uploads from its own event loop, and
+ * the protocol core can be benchmarked without hardware.
+ *
+ * The returned actions point into the state machine and stay valid
+ * until the next call on it. Messages are for logging only, the library
+ * never prints.
+ *
+ * This header only uses its own WASP1_ and WASP2_ names, so both stages
+ * can be used from the same translation unit.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef LIBWASP_H
+#define LIBWASP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Stage 1: MDIO
+ *
+ * Start with WASP1_EV_START, then answer every action with its event:
+ *   WASP1_ACT_READ   read the register at location, not before deadline,
+ *                    and feed the value with WASP1_EV_READ. If poll is
+ *                    set, the read waits for a command to complete: the
+ *                    caller may instead poll with its own strategy until
+ *                    it reads expected or gives up, and feed the last
+ *                    value with WASP1_EV_POLLED.
+ *   WASP1_ACT_WRITE  write the registers in order, as one transaction
+ *                    if batch is set, then feed WASP1_EV_WRITTEN. Writes
+ *                    flagged WASP1_WRITE_DATA may be skipped if the
+ *                    register is known to hold the value already; after
+ *                    a write with invalidate set nothing is known any
+ *                    more.
+ * Any failed register access is fed as WASP1_EV_ERROR. The upload ends
+ * with WASP1_ACT_DONE or WASP1_ACT_FAILED.
+ */
+
+#define WASP1_MAX_WRITES	8
+#define WASP1_WRITE_DATA	0x01
+
+typedef struct t_wasp1 t_wasp1;
+struct t_plan;
+
+typedef enum {
+	WASP1_ACT_READ,
+	WASP1_ACT_WRITE,
+	WASP1_ACT_DONE,
+	WASP1_ACT_FAILED
+} t_wasp1_act;
+
+typedef enum {
+	WASP1_EV_START,
+	WASP1_EV_READ,
+	WASP1_EV_POLLED,
+	WASP1_EV_WRITTEN,
+	WASP1_EV_ERROR
+} t_wasp1_ev;
+
+typedef struct {
+	uint16_t location;
+	uint16_t value;
+	uint8_t flags;
+} t_wasp1_write;
+
+typedef struct {
+	t_wasp1_act type;
+	uint64_t deadline;		/* ns, do not act before */
+	const char *phase;		/* current upload phase */
+	const char *msg;		/* optional progress or error message */
+	/* WASP1_ACT_READ */
+	int location;
+	int poll;
+	int expected;
+	/* WASP1_ACT_WRITE */
+	int batch;
+	int invalidate;
+	int count;
+	t_wasp1_write writes[WASP1_MAX_WRITES];
+} t_wasp1_action;
+
+/* Upload a compiled plan, which must stay valid until wasp1_free() */
+t_wasp1 *wasp1_new(const struct t_plan *plan);
+/* Upload an image to the given model ("3390" or "3490") */
+t_wasp1 *wasp1_new_image(const char *model, const uint8_t *data, size_t size);
+const t_wasp1_action *wasp1_step(t_wasp1 *sm, t_wasp1_ev ev, int value, uint64_t now_ns);
+/* Status reads spent waiting for the booting firmware */
+unsigned long wasp1_handshake_polls(const t_wasp1 *sm);
+void wasp1_free(t_wasp1 *sm);
+
+/*
+ * Stage 2: Ethernet
+ *
+ * One state machine serves one WASP. Every frame from it is fed with
+ * wasp2_frame(), starting at the Ethernet payload; when the deadline of
+ * the last action has passed, call wasp2_timer(). Actions:
+ *   WASP2_ACT_NONE    nothing to send, wait for a frame or the deadline
+ *                     (0 for none)
+ *   WASP2_ACT_SEND    send the chunks first to first + count - 1, each
+ *                     built with wasp2_chunk() behind an Ethernet header
+ *                     addressed to the WASP with WASP2_ETHER_TYPE
+ *   WASP2_ACT_DONE    the firmware, and the config if any, are uploaded
+ *   WASP2_ACT_FAILED  the WASP reported an error or stopped answering
+ */
+
+#define WASP2_ETHER_TYPE	0x88bd
+#define WASP2_HEADER_LEN	14
+/* I/O vectors wasp2_chunk() fills at most */
+#define WASP2_CHUNK_IOV		4
+#define WASP2_MAX_WINDOW	64
+/* Largest chunk size negotiated, see t_wasp2_params */
+#define WASP2_MAX_CHUNK		8192
+
+typedef struct t_wasp2 t_wasp2;
+
+typedef enum {
+	WASP2_ACT_NONE,
+	WASP2_ACT_SEND,
+	WASP2_ACT_DONE,
+	WASP2_ACT_FAILED
+} t_wasp2_act;
+
+typedef struct {
+	t_wasp2_act type;
+	uint64_t deadline;		/* ns, call wasp2_timer() then, 0 for none */
+	const char *phase;		/* current upload phase */
+	const char *msg;		/* optional progress or error message */
+	const char *debug;		/* optional detail for verbose logging */
+	int started;			/* a new download starts, chunks count from 0 */
+	int first;
+	int count;
+	int resized;			/* chunks from this one on were cut anew, 0 for none */
+	uint64_t rtt_ns;		/* ACK round trip just measured, 0 if none */
+} t_wasp2_action;
+
+typedef struct {
+	int ack_timeout;		/* ms */
+	int retries;
+	int window;				/* frames in flight once probed, 1 to 64 */
+	int strict;				/* trust the echoed ACK counters from the start */
+	/*
+	 * Chunks are 1024 bytes by default. Above that, the first chunks of
+	 * every image probe for the largest size the WASP accepts, doubling
+	 * up to max_chunk; a chunk it rejects or does not acknowledge is sent
+	 * again at the last accepted size, which is kept from then on. With
+	 * chunk_hint, from an earlier upload, only that size is tried.
+	 */
+	int max_chunk;			/* bytes, at most WASP2_MAX_CHUNK */
+	int chunk_hint;
+} t_wasp2_params;
+
+typedef struct {
+	unsigned long sent;
+	unsigned long retransmits;
+	unsigned long bytes;	/* acknowledged image bytes */
+	unsigned long duplicate_acks;	/* for chunks already acknowledged, ignored */
+	unsigned long unexpected_acks;	/* for chunks never sent */
+	unsigned long chunk_size;	/* the firmware was sent in, once negotiated */
+} t_wasp2_stats;
+
+/* The images are shared, not copied, and must stay valid */
+t_wasp2 *wasp2_new(const uint8_t *firmware, size_t firmware_size,
+	const uint8_t *config, size_t config_size, const t_wasp2_params *params);
+const t_wasp2_action *wasp2_frame(t_wasp2 *sm, const uint8_t *frame, size_t len, uint64_t now_ns);
+const t_wasp2_action *wasp2_timer(t_wasp2 *sm, uint64_t now_ns);
+/* WASP header and payload of a chunk of the current image, returns the iov count */
+int wasp2_chunk(const t_wasp2 *sm, int index, uint8_t hdr[WASP2_HEADER_LEN], struct iovec *iov);
+int wasp2_num_chunks(const t_wasp2 *sm);
+/*
+ * Everything of the current image before the returned pointer is
+ * acknowledged and not sent again in this download, NULL if none runs
+ */
+const uint8_t *wasp2_acked(const t_wasp2 *sm);
+void wasp2_get_stats(const t_wasp2 *sm, t_wasp2_stats *stats);
+void wasp2_free(t_wasp2 *sm);
+
+#endif
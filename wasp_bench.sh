@@ -0,0 +1,183 @@
+#!/bin/sh
+#
+# Provisioning benchmark: runs both uploaders against local stand-ins
+# over a matrix of image sizes, device latencies and loss rates, writes
+# the results as CSV and JSON and compares them against a baseline.
+#
+# Stage 1 talks to the simulated MDIO WASP, stage 2 to the WASP
+# emulator in its own network namespace. Every run writes a JSON
+# report, the results are summed up from its phases. Needs root.
+#
+# The check fails if the transfer time over all loss free cases that are
+# also in the baseline grew by more than BENCH_THRESHOLD percent. The
+# transfer time of a run is the sum of its phases, without discovery and
+# the waits for the WASP to boot, which only measure the stand-ins. Runs
+# with loss are dominated by retransmission timeouts and only reported.
+# Timings still only compare on the same machine: refresh the baseline
+# with BENCH_UPDATE=1 on every machine the check runs on, the checked-in
+# one is only an example.
+#
+# Environment:
+#   BENCH_OUT        directory for results.csv and results.json
+#                    (default: bench-results)
+#   BENCH_BASELINE   baseline CSV (default: wasp_bench_baseline.csv)
+#   BENCH_THRESHOLD  allowed regression in percent (default: 10)
+#   BENCH_UPDATE     set to 1 to replace the baseline with this run
+#   S1_MODEL         stage 1 model (default: 3490)
+#   S1_SIZES         stage 1 image sizes in bytes (default: "16384 65532")
+#   S1_LATENCIES     MDIO access latencies in us (default: "0 20")
+#   S2_SIZES         stage 2 firmware sizes in KiB (default: "1024 8192")
+#   S2_LATENCIES     WASP reply delays in us (default: "0 200")
+#   S2_LOSS          frame loss rates in percent (default: "0 1")
+#   UPLOADER_ARGS    extra stage 2 uploader options, e.g. "-w 8"
+#
+# (c) 2019-2020 Andreas Böhler
+# GPLv2
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+OUT=${BENCH_OUT:-bench-results}
+BASELINE=${BENCH_BASELINE:-$DIR/wasp_bench_baseline.csv}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+S1_MODEL=${S1_MODEL:-3490}
+S1_SIZES=${S1_SIZES:-16384 65532}
+S1_LATENCIES=${S1_LATENCIES:-0 20}
+S2_SIZES=${S2_SIZES:-1024 8192}
+S2_LATENCIES=${S2_LATENCIES:-0 200}
+S2_LOSS=${S2_LOSS:-0 1}
+NS=wasp-bench-ns
+HOST_IF=wasp-nsb0
+WASP_IF=wasp-nsb1
+TMP=$(mktemp -d)
+
+cleanup() {
+	ip link del "$HOST_IF" 2>/dev/null || true
+	ip netns del "$NS" 2>/dev/null || true
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# Sum a numeric field over all phases of a report
+field_sum() {
+	sed -n "s/.*\"$1\": \([0-9][0-9]*\).*/\1/p" "$2" | awk '{ s += $1 } END { print s + 0 }'
+}
+
+# Sum the durations of the phases that move data, see above
+transfer_sum() {
+	grep '"duration_us"' "$1" | grep -v -e '"name": "[a-z_]*discovery"' -e '"name": "wait_' |
+		sed -n 's/.*"duration_us": \([0-9][0-9]*\).*/\1/p' | awk '{ s += $1 } END { print s + 0 }'
+}
+
+# Append the results of a report: case, stage, size, latency, loss
+record() {
+	report=$TMP/report.json
+	total=$(sed -n 's/.*"total_us": \([0-9][0-9]*\).*/\1/p' "$report")
+	awk -v c="$1" -v st="$2" -v size="$3" -v lat="$4" -v loss="$5" -v total="$total" \
+		-v transfer="$(transfer_sum "$report")" \
+		-v user="$(field_sum user_us "$report")" -v sys="$(field_sum sys_us "$report")" \
+		-v ioctl="$(field_sum ioctl "$report")" -v nanosleep="$(field_sum nanosleep "$report")" \
+		-v poll="$(field_sum poll "$report")" -v send="$(field_sum send "$report")" \
+		-v recv="$(field_sum recv "$report")" 'BEGIN {
+		printf "%s,%s,%d,%d,%s,%d,%d,%.1f,%d,%d,%d,%d,%d,%d,%d\n", c, st, size, lat, loss,
+			total, transfer, (total > 0 ? size / 1024 / (total / 1e6) : 0), user, sys,
+			ioctl, nanosleep, poll, send, recv
+	}' >>"$OUT/results.csv"
+	printf "  %-28s %10.3f ms, transfer %10.3f ms\n" "$1" \
+		"$(awk -v t="$total" 'BEGIN { print t / 1000 }')" \
+		"$(awk -v t="$(transfer_sum "$report")" 'BEGIN { print t / 1000 }')"
+}
+
+mkdir -p "$OUT"
+echo "case,stage,size,latency_us,loss_pct,total_us,transfer_us,kb_per_s,user_us,sys_us,ioctl,nanosleep,poll,send,recv" >"$OUT/results.csv"
+
+echo "Stage 1, model $S1_MODEL on the simulated MDIO bus:"
+for size in $S1_SIZES; do
+	dd if=/dev/urandom of="$TMP/stage1.bin" bs="$size" count=1 2>/dev/null
+	for lat in $S1_LATENCIES; do
+		"$DIR/wasp_uploader_stage1" -m "$S1_MODEL" -t "sim,latency=$lat" -f "$TMP/stage1.bin" \
+			-j "$TMP/report.json" >"$TMP/stage1.log"
+		record "s1-$size-$lat" 1 "$size" "$lat" 0
+	done
+done
+
+ip netns add "$NS"
+ip link add "$HOST_IF" type veth peer name "$WASP_IF" netns "$NS"
+ip -n "$NS" link set lo up
+ip -n "$NS" link set "$WASP_IF" up
+ip link set "$HOST_IF" up
+sleep 1
+
+echo "Stage 2 against the emulated WASP:"
+dd if=/dev/urandom of="$TMP/config.tgz" bs=1000 count=5 2>/dev/null
+for kb in $S2_SIZES; do
+	dd if=/dev/urandom of="$TMP/fw.bin" bs=1024 count="$kb" 2>/dev/null
+	for lat in $S2_LATENCIES; do
+		for loss in $S2_LOSS; do
+			ip netns exec "$NS" "$DIR/wasp_stage2_emu" -i "$WASP_IF" -f "$TMP/fw.bin" \
+				-c "$TMP/config.tgz" -d "$lat" -l "$loss" >"$TMP/emu.log" &
+			EMU=$!
+			sleep 0.2
+			"$DIR/wasp_uploader_stage2" -i "$HOST_IF" -f "$TMP/fw.bin" -c "$TMP/config.tgz" \
+				-j "$TMP/report.json" $UPLOADER_ARGS >"$TMP/stage2.log"
+			wait $EMU
+			record "s2-$kb-$lat-$loss" 2 $((kb * 1024 + 5000)) "$lat" "$loss"
+		done
+	done
+done
+
+# The same rows as JSON
+awk -F, 'NR == 1 { for(i = 1; i <= NF; i++) name[i] = $i; printf "[\n"; next }
+	{
+		printf "%s  {", (NR > 2 ? ",\n" : "")
+		for(i = 1; i <= NF; i++)
+			printf "%s\"%s\": %s", (i > 1 ? ", " : ""), name[i], (i == 1 ? "\"" $i "\"" : $i)
+		printf "}"
+	}
+	END { printf "\n]\n" }' "$OUT/results.csv" >"$OUT/results.json"
+echo "Results written to $OUT/results.csv and $OUT/results.json."
+
+if [ "$BENCH_UPDATE" = 1 ]; then
+	cp "$OUT/results.csv" "$BASELINE"
+	echo "Baseline updated."
+	exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+	echo "No baseline at $BASELINE, run with BENCH_UPDATE=1 to create one."
+	exit 0
+fi
+
+# Compare the loss free cases both runs have, columns by their names
+awk -F, -v threshold="$THRESHOLD" '
+	FNR == 1 {
+		for(i = 1; i <= NF; i++)
+			col[FILENAME, $i] = i
+		if(!col[FILENAME, "transfer_us"]) {
+			print "The baseline has no transfer times, refresh it with BENCH_UPDATE=1."
+			failed = 1
+			exit 0
+		}
+		t = col[FILENAME, "transfer_us"]
+		l = col[FILENAME, "loss_pct"]
+		next
+	}
+	NR == FNR { if($l == 0) base[$1] = $t; next }
+	$1 in base {
+		printf "  %-28s %+7.1f %%\n", $1, (base[$1] > 0 ? ($t - base[$1]) * 100 / base[$1] : 0)
+		old += base[$1]
+		new += $t
+	}
+	END {
+		if(failed)
+			exit 0
+		if(old == 0) {
+			print "No loss free cases in common with the baseline."
+			exit 0
+		}
+		diff = (new - old) * 100 / old
+		printf "Transfer time %.3f ms, baseline %.3f ms (%+.1f %%).\n", new / 1000, old / 1000, diff
+		if(diff > threshold) {
+			printf "Regression of more than %s %%.\n", threshold
+			exit 1
+		}
+	}' "$BASELINE" "$OUT/results.csv"
@@ -0,0 +1,243 @@
+/*
+ * pcapng capture for the AVM WASP uploaders
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "wasp_capture.h"
+
+#define BLOCK_SHB		0x0a0d0d0a
+#define BLOCK_IDB		0x00000001
+#define BLOCK_EPB		0x00000006
+#define BYTE_ORDER_MAGIC	0x1a2b3c4d
+
+#define OPT_ENDOFOPT	0
+#define OPT_IF_TSRESOL	9
+#define OPT_EPB_FLAGS	2
+
+/* Enhanced packet block without data: header, flags option, end, length */
+#define EPB_OVERHEAD	(28 + 8 + 4 + 4)
+
+#define PAD4(x)			(((x) + 3) & ~3u)
+
+struct t_capture {
+	FILE *fp;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int closing;
+
+	/* Ring of finished blocks, [tail, head) is waiting to be written */
+	uint8_t *ring;
+	size_t head;
+	size_t tail;
+	size_t used;
+
+	unsigned long records;
+	unsigned long dropped;
+};
+
+static void put32(uint8_t **p, uint32_t val) {
+	memcpy(*p, &val, 4);
+	*p += 4;
+}
+
+static void put16(uint8_t **p, uint16_t val) {
+	memcpy(*p, &val, 2);
+	*p += 2;
+}
+
+/* Copy into the ring at head, wrapping around the end */
+static void ring_put(t_capture *cap, const void *data, size_t len) {
+	size_t first = CAPTURE_RING_SIZE - cap->head;
+
+	if(first > len)
+		first = len;
+	memcpy(cap->ring + cap->head, data, first);
+	memcpy(cap->ring, (const uint8_t *)data + first, len - first);
+	cap->head = (cap->head + len) % CAPTURE_RING_SIZE;
+	cap->used += len;
+}
+
+/*
+ * The writer sleeps until a quarter of the ring is in use or the capture
+ * is closed, then writes out everything queued without holding the lock.
+ */
+static void *capture_writer(void *arg) {
+	t_capture *cap = arg;
+
+	pthread_mutex_lock(&cap->lock);
+	while(1) {
+		size_t tail, len;
+
+		while(!cap->closing && cap->used < CAPTURE_RING_SIZE / 4)
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		if(!cap->used && cap->closing)
+			break;
+
+		tail = cap->tail;
+		len = cap->used;
+		pthread_mutex_unlock(&cap->lock);
+
+		if(tail + len > CAPTURE_RING_SIZE) {
+			fwrite(cap->ring + tail, 1, CAPTURE_RING_SIZE - tail, cap->fp);
+			fwrite(cap->ring, 1, tail + len - CAPTURE_RING_SIZE, cap->fp);
+		} else {
+			fwrite(cap->ring + tail, 1, len, cap->fp);
+		}
+
+		pthread_mutex_lock(&cap->lock);
+		cap->tail = (tail + len) % CAPTURE_RING_SIZE;
+		cap->used -= len;
+	}
+	pthread_mutex_unlock(&cap->lock);
+	return NULL;
+}
+
+t_capture *capture_open(const char *filename, uint16_t linktype) {
+	uint8_t hdr[28 + 32];
+	uint8_t *p = hdr;
+	t_capture *cap;
+
+	cap = calloc(1, sizeof(*cap));
+	if(!cap)
+		return NULL;
+	cap->ring = malloc(CAPTURE_RING_SIZE);
+	cap->fp = fopen(filename, "wb");
+	if(!cap->ring || !cap->fp) {
+		perror(filename);
+		goto err;
+	}
+
+	/* Section header block, native byte order */
+	put32(&p, BLOCK_SHB);
+	put32(&p, 28);
+	put32(&p, BYTE_ORDER_MAGIC);
+	put16(&p, 1);
+	put16(&p, 0);
+	put32(&p, 0xffffffff);	/* section length unknown */
+	put32(&p, 0xffffffff);
+	put32(&p, 28);
+
+	/* Interface description block with nanosecond timestamps */
+	put32(&p, BLOCK_IDB);
+	put32(&p, 32);
+	put16(&p, linktype);
+	put16(&p, 0);
+	put32(&p, CAPTURE_SNAPLEN);
+	put16(&p, OPT_IF_TSRESOL);
+	put16(&p, 1);
+	put32(&p, 9);			/* 10^-9, padded */
+	put16(&p, OPT_ENDOFOPT);
+	put16(&p, 0);
+	put32(&p, 32);
+
+	if(fwrite(hdr, 1, sizeof(hdr), cap->fp) != sizeof(hdr)) {
+		perror(filename);
+		goto err;
+	}
+
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+	if(pthread_create(&cap->thread, NULL, capture_writer, cap) != 0) {
+		fprintf(stderr, "Could not start the capture writer.\n");
+		goto err;
+	}
+	return cap;
+
+err:
+	if(cap->fp)
+		fclose(cap->fp);
+	free(cap->ring);
+	free(cap);
+	return NULL;
+}
+
+/* Queue one record, built from iov, as an enhanced packet block */
+void capture_packet(t_capture *cap, const struct iovec *iov, int iovcnt, int direction) {
+	uint8_t hdr[28];
+	uint8_t trailer[16];
+	uint8_t *p = hdr;
+	static const uint8_t pad[4];
+	struct timespec ts;
+	uint64_t ns;
+	size_t len = 0, caplen, left, block_len;
+	int i;
+
+	if(!cap)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	caplen = len > CAPTURE_SNAPLEN ? CAPTURE_SNAPLEN : len;
+	block_len = EPB_OVERHEAD + PAD4(caplen);
+
+	put32(&p, BLOCK_EPB);
+	put32(&p, block_len);
+	put32(&p, 0);			/* interface */
+	put32(&p, ns >> 32);
+	put32(&p, ns);
+	put32(&p, caplen);
+	put32(&p, len);
+
+	p = trailer;
+	put16(&p, OPT_EPB_FLAGS);
+	put16(&p, 4);
+	put32(&p, direction);
+	put16(&p, OPT_ENDOFOPT);
+	put16(&p, 0);
+	put32(&p, block_len);
+
+	pthread_mutex_lock(&cap->lock);
+	if(CAPTURE_RING_SIZE - cap->used < block_len) {
+		cap->dropped++;
+		pthread_mutex_unlock(&cap->lock);
+		return;
+	}
+
+	ring_put(cap, hdr, sizeof(hdr));
+	left = caplen;
+	for(i = 0; i < iovcnt && left; i++) {
+		size_t chunk = iov[i].iov_len < left ? iov[i].iov_len : left;
+
+		ring_put(cap, iov[i].iov_base, chunk);
+		left -= chunk;
+	}
+	ring_put(cap, pad, PAD4(caplen) - caplen);
+	ring_put(cap, trailer, sizeof(trailer));
+	cap->records++;
+
+	if(cap->used >= CAPTURE_RING_SIZE / 4)
+		pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* Flush everything still queued and close the file */
+void capture_close(t_capture *cap) {
+	if(!cap)
+		return;
+
+	pthread_mutex_lock(&cap->lock);
+	cap->closing = 1;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+
+	if(cap->dropped)
+		fprintf(stderr, "Capture: %lu of %lu records dropped, the writer fell behind.\n",
+			cap->dropped, cap->records + cap->dropped);
+	fclose(cap->fp);
+	pthread_mutex_destroy(&cap->lock);
+	pthread_cond_destroy(&cap->cond);
+	free(cap->ring);
+	free(cap);
+}
@@ -0,0 +1,58 @@
+/*
+ * pcapng capture for the AVM WASP uploaders
+ *
+ * Records are appended to an in-memory ring and written to the file by
+ * a background thread, so capturing costs a copy and an uncontended
+ * lock per record on the upload path. If the writer falls behind, records
+ * are dropped and counted rather than stalling the upload.
+ *
+ * Stage 2 captures Ethernet frames. Stage 1 captures MDIO register
+ * accesses with link type LINKTYPE_USER0, one 6 byte record per access,
+ * all fields big endian:
+ *
+ *   uint8_t  op        CAPTURE_MDIO_READ or CAPTURE_MDIO_WRITE
+ *   uint8_t  flags     CAPTURE_MDIO_BATCH if part of a batched write
+ *   uint16_t location  register number
+ *   uint16_t value
+ *
+ * Timestamps have nanosecond resolution.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_CAPTURE_H
+#define WASP_CAPTURE_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define CAPTURE_LINKTYPE_ETHERNET	1
+#define CAPTURE_LINKTYPE_MDIO		147	/* LINKTYPE_USER0 */
+
+#define CAPTURE_RING_SIZE	(1024 * 1024)
+#define CAPTURE_SNAPLEN		2048
+
+#define CAPTURE_IN			1
+#define CAPTURE_OUT			2
+
+#define CAPTURE_MDIO_READ	0
+#define CAPTURE_MDIO_WRITE	1
+#define CAPTURE_MDIO_BATCH	0x01
+
+typedef struct t_capture t_capture;
+
+t_capture *capture_open(const char *filename, uint16_t linktype);
+void capture_packet(t_capture *cap, const struct iovec *iov, int iovcnt, int direction);
+void capture_close(t_capture *cap);
+
+static inline void capture_mdio(t_capture *cap, int op, int flags, int location, int value) {
+	uint8_t rec[6] = {
+		op, flags, location >> 8, location, value >> 8, value
+	};
+	struct iovec iov = { rec, sizeof(rec) };
+
+	capture_packet(cap, &iov, 1, op == CAPTURE_MDIO_READ ? CAPTURE_IN : CAPTURE_OUT);
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Image checksum for the AVM WASP stage 1 bootloader
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <string.h>
+
+#include "wasp_checksum.h"
+
+#if !defined(WASP_CHECKSUM_PORTABLE) && defined(__SSE2__)
+#define CHECKSUM_SSE2
+#include <emmintrin.h>
+#elif !defined(WASP_CHECKSUM_PORTABLE) && defined(__ARM_NEON)
+#define CHECKSUM_NEON
+#include <arm_neon.h>
+#endif
+
+static inline uint32_t load_be32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Sum of the big endian words in data, len is a multiple of 4 */
+static uint32_t sum_words_portable(const uint8_t *data, size_t len) {
+	uint32_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+	size_t i = 0;
+
+	for(; i + 16 <= len; i += 16) {
+		sum0 += load_be32(data + i);
+		sum1 += load_be32(data + i + 4);
+		sum2 += load_be32(data + i + 8);
+		sum3 += load_be32(data + i + 12);
+	}
+	for(; i < len; i += 4)
+		sum0 += load_be32(data + i);
+
+	return sum0 + sum1 + sum2 + sum3;
+}
+
+#if defined(CHECKSUM_SSE2)
+const char *const wasp_checksum_impl = "sse2";
+
+static inline __m128i bswap32_sse2(__m128i v) {
+	/* swap the 16 bit halves of each word, then the bytes of each half */
+	v = _mm_shufflelo_epi16(v, 0xb1);
+	v = _mm_shufflehi_epi16(v, 0xb1);
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static uint32_t sum_words(const uint8_t *data, size_t len) {
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	uint32_t lanes[4];
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(data + i + 16));
+		acc0 = _mm_add_epi32(acc0, bswap32_sse2(v0));
+		acc1 = _mm_add_epi32(acc1, bswap32_sse2(v1));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc0, acc1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		sum_words_portable(data + i, len - i);
+}
+#elif defined(CHECKSUM_NEON)
+const char *const wasp_checksum_impl = "neon";
+
+static uint32_t sum_words(const uint8_t *data, size_t len) {
+	uint32x4_t acc0 = vdupq_n_u32(0);
+	uint32x4_t acc1 = vdupq_n_u32(0);
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32) {
+		uint8x16_t v0 = vrev32q_u8(vld1q_u8(data + i));
+		uint8x16_t v1 = vrev32q_u8(vld1q_u8(data + i + 16));
+		acc0 = vaddq_u32(acc0, vreinterpretq_u32_u8(v0));
+		acc1 = vaddq_u32(acc1, vreinterpretq_u32_u8(v1));
+	}
+	acc0 = vaddq_u32(acc0, acc1);
+
+	return vgetq_lane_u32(acc0, 0) + vgetq_lane_u32(acc0, 1) +
+		vgetq_lane_u32(acc0, 2) + vgetq_lane_u32(acc0, 3) +
+		sum_words_portable(data + i, len - i);
+}
+#else
+const char *const wasp_checksum_impl = "portable";
+
+#define sum_words sum_words_portable
+#endif
+
+static uint32_t checksum_finish(uint32_t sum, const uint8_t *data, size_t len) {
+	size_t full = len & ~(size_t)3;
+	size_t words = (len + 3) / 4;
+
+	if(full != len) {
+		uint8_t tail[4] = {0, 0, 0, 0};
+		memcpy(tail, data + full, len - full);
+		sum += load_be32(tail);
+	}
+	return 0xffffffff - sum - (uint32_t)(words - 1);
+}
+
+uint32_t wasp_checksum(const uint8_t *data, size_t len) {
+	return checksum_finish(sum_words(data, len & ~(size_t)3), data, len);
+}
+
+uint32_t wasp_checksum_portable(const uint8_t *data, size_t len) {
+	return checksum_finish(sum_words_portable(data, len & ~(size_t)3), data, len);
+}
@@ -0,0 +1,27 @@
+/*
+ * Image checksum for the AVM WASP stage 1 bootloader
+ *
+ * All big endian 32 bit words of the image are subtracted from
+ * 0xffffffff, then the number of words minus one is subtracted. A
+ * trailing partial word is padded with zeros.
+ *
+ * The summation kernel is chosen at build time: SSE2 or NEON when the
+ * compiler targets them, a portable word-at-a-time loop otherwise.
+ * Define WASP_CHECKSUM_PORTABLE to force the portable kernel.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_CHECKSUM_H
+#define WASP_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern const char *const wasp_checksum_impl;
+
+uint32_t wasp_checksum(const uint8_t *data, size_t len);
+uint32_t wasp_checksum_portable(const uint8_t *data, size_t len);
+
+#endif
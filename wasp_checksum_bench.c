@@ -0,0 +1,140 @@
+/*
+ * Micro benchmark for the AVM WASP checksum kernel
+ *
+ * Verifies the built-in kernel against golden values and against the
+ * portable kernel for all lengths and alignments of small buffers,
+ * then measures the throughput of both.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wasp_checksum.h"
+
+#define BENCH_MIN_NS	200000000ull
+
+typedef struct {
+	size_t len;
+	int pattern;
+	uint32_t checksum;
+} t_golden;
+
+static const t_golden golden[] = {
+	{ 0,     0, 0x00000000 },
+	{ 1,     1, 0xfeffffff },
+	{ 4,     1, 0xfefdfcfb },
+	{ 5,     1, 0xf9fdfcfa },
+	{ 1024,  2, 0x807f7e00 },
+	{ 65533, 3, 0xe10f35fc },
+	{ 65535, 4, 0x000000ff },
+};
+
+static void fill(uint8_t *buf, size_t len, int pattern) {
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		switch(pattern) {
+		case 1: buf[i] = i + 1; break;
+		case 2: buf[i] = i & 0xff; break;
+		case 3: buf[i] = (i * 7 + 3) & 0xff; break;
+		case 4: buf[i] = 0xff; break;
+		default: buf[i] = 0; break;
+		}
+	}
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int verify(void) {
+	uint8_t *buf = malloc(65536 + 16);
+	size_t i, len, align;
+	int errors = 0;
+
+	if(!buf)
+		return -1;
+
+	for(i = 0; i < sizeof(golden) / sizeof(golden[0]); i++) {
+		uint32_t cs;
+
+		fill(buf, golden[i].len, golden[i].pattern);
+		cs = wasp_checksum(buf, golden[i].len);
+		if(cs != golden[i].checksum || wasp_checksum_portable(buf, golden[i].len) != cs) {
+			fprintf(stderr, "golden value mismatch: len %zu: 0x%08x != 0x%08x\n",
+				golden[i].len, cs, golden[i].checksum);
+			errors++;
+		}
+	}
+
+	srand(1);
+	for(i = 0; i < 65536 + 16; i++)
+		buf[i] = rand();
+	for(align = 0; align < 16; align++) {
+		for(len = 0; len <= 300; len++) {
+			if(wasp_checksum(buf + align, len) != wasp_checksum_portable(buf + align, len)) {
+				fprintf(stderr, "kernel mismatch: align %zu, len %zu\n", align, len);
+				errors++;
+			}
+		}
+	}
+
+	free(buf);
+	return errors ? -1 : 0;
+}
+
+static void bench(const char *name, uint32_t (*fn)(const uint8_t *, size_t),
+	const uint8_t *buf, size_t len) {
+	volatile uint32_t sink = 0;
+	unsigned long iter = 0;
+	uint64_t start = now_ns();
+	uint64_t elapsed;
+
+	do {
+		int i;
+
+		for(i = 0; i < 256; i++)
+			sink += fn(buf, len);
+		iter += 256;
+		elapsed = now_ns() - start;
+	} while(elapsed < BENCH_MIN_NS);
+	(void)sink;
+
+	printf("%-9s %8zu bytes: %8.1f ns/call, %8.1f MB/s\n", name, len,
+		(double)elapsed / iter, (double)len * iter / (elapsed / 1e9) / 1e6);
+}
+
+int main(void) {
+	static const size_t sizes[] = { 14, 1024, 65535, 8 * 1024 * 1024 };
+	uint8_t *buf;
+	size_t i;
+
+	printf("Checksum kernel: %s\n", wasp_checksum_impl);
+
+	if(verify() < 0) {
+		fprintf(stderr, "Checksum verification failed!\n");
+		return EXIT_FAILURE;
+	}
+	printf("Golden values and cross-check OK.\n");
+
+	buf = malloc(sizes[3]);
+	if(!buf)
+		return EXIT_FAILURE;
+	fill(buf, sizes[3], 3);
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench(wasp_checksum_impl, wasp_checksum, buf, sizes[i]);
+		bench("portable", wasp_checksum_portable, buf, sizes[i]);
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
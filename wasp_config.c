@@ -0,0 +1,375 @@
+/*
+ * Stage 2 config archive built from a directory
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "wasp_config.h"
+#include "wasp_file.h"
+
+#define TAR_BLOCK		512
+#define CONFIG_HEADER_LEN	(8 + 4 + 8 + 4)
+
+typedef struct {
+	char *name;		/* "./" followed by the path below the directory */
+	mode_t mode;
+	time_t mtime;
+	t_image data;
+} t_config_file;
+
+typedef struct {
+	t_config_file *files;
+	size_t count;
+	size_t cap;
+} t_config_tree;
+
+/* Growing output buffer behind the deflate stream */
+typedef struct {
+	z_stream zs;
+	uint8_t *buf;
+	size_t cap;
+} t_config_gz;
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void tree_free(t_config_tree *tree) {
+	size_t i;
+
+	for(i = 0; i < tree->count; i++) {
+		free(tree->files[i].name);
+		image_free(&tree->files[i].data);
+	}
+	free(tree->files);
+	memset(tree, 0, sizeof(*tree));
+}
+
+/* Collect the regular files below dir/rel in sorted order */
+static int tree_scan(t_config_tree *tree, const char *dir, const char *rel) {
+	char **names = NULL;
+	size_t count = 0, cap = 0, i;
+	struct dirent *de;
+	DIR *d;
+	char *path;
+	int ret = 0;
+
+	path = malloc(strlen(dir) + strlen(rel) + 2);
+	if(!path)
+		return -1;
+	sprintf(path, "%s/%s", dir, rel);
+	d = opendir(path);
+	free(path);
+	if(!d)
+		return -1;
+
+	while((de = readdir(d))) {
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if(count == cap) {
+			char **tmp = realloc(names, (cap ? cap * 2 : 16) * sizeof(*names));
+			if(!tmp) {
+				ret = -1;
+				goto out;
+			}
+			names = tmp;
+			cap = cap ? cap * 2 : 16;
+		}
+		names[count] = malloc(strlen(rel) + strlen(de->d_name) + 2);
+		if(!names[count]) {
+			ret = -1;
+			goto out;
+		}
+		sprintf(names[count++], "%s/%s", rel, de->d_name);
+	}
+	qsort(names, count, sizeof(*names), compare_names);
+
+	for(i = 0; i < count && ret == 0; i++) {
+		struct stat st;
+		t_config_file *file;
+
+		path = malloc(strlen(dir) + strlen(names[i]) + 2);
+		if(!path) {
+			ret = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", dir, names[i]);
+		if(lstat(path, &st) < 0) {
+			perror(path);
+			ret = -1;
+		} else if(S_ISDIR(st.st_mode)) {
+			ret = tree_scan(tree, dir, names[i]);
+		} else if(S_ISREG(st.st_mode)) {
+			if(tree->count == tree->cap) {
+				t_config_file *tmp = realloc(tree->files,
+					(tree->cap ? tree->cap * 2 : 16) * sizeof(*tmp));
+				if(!tmp) {
+					free(path);
+					ret = -1;
+					break;
+				}
+				tree->files = tmp;
+				tree->cap = tree->cap ? tree->cap * 2 : 16;
+			}
+			file = &tree->files[tree->count];
+			memset(file, 0, sizeof(*file));
+			file->mode = st.st_mode & 07777;
+			file->mtime = st.st_mtime;
+			if(image_load(&file->data, path, IMAGE_COPY) < 0) {
+				perror(path);
+				ret = -1;
+			} else {
+				/* names[i] starts with the "." passed in as rel */
+				file->name = names[i];
+				names[i] = NULL;
+				tree->count++;
+			}
+		}
+		free(path);
+	}
+
+out:
+	for(i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	closedir(d);
+	return ret;
+}
+
+static uint64_t tree_hash(const t_config_tree *tree) {
+	uint64_t hash = FILE_HASH_INIT;
+	uint8_t meta[12];
+	size_t i;
+
+	for(i = 0; i < tree->count; i++) {
+		const t_config_file *file = &tree->files[i];
+
+		hash = file_hash(hash, file->name, strlen(file->name) + 1);
+		file_put_be(file_put_be(meta, file->mode, 4), file->data.size, 8);
+		hash = file_hash(hash, meta, sizeof(meta));
+		hash = file_hash(hash, file->data.data, file->data.size);
+	}
+	return hash;
+}
+
+static int gz_write(t_config_gz *gz, const void *data, size_t len, int flush) {
+	int ret;
+
+	gz->zs.next_in = (Bytef *)data;
+	gz->zs.avail_in = len;
+	do {
+		if(gz->zs.total_out == gz->cap) {
+			uint8_t *tmp = realloc(gz->buf, gz->cap * 2);
+			if(!tmp)
+				return -1;
+			gz->buf = tmp;
+			gz->cap *= 2;
+		}
+		gz->zs.next_out = gz->buf + gz->zs.total_out;
+		gz->zs.avail_out = gz->cap - gz->zs.total_out;
+		ret = deflate(&gz->zs, flush);
+		if(ret == Z_STREAM_ERROR)
+			return -1;
+	} while(gz->zs.avail_in || (flush == Z_FINISH && ret != Z_STREAM_END));
+	return 0;
+}
+
+/* ustar header for one file, long names are split into prefix and name */
+static int tar_header(uint8_t *hdr, const t_config_file *file) {
+	size_t len = strlen(file->name);
+	const char *name = file->name;
+	unsigned int sum = 0;
+	size_t i;
+
+	memset(hdr, 0, TAR_BLOCK);
+	if(len > 100) {
+		const char *slash = file->name + len - 101;
+
+		while(*slash && *slash != '/')
+			slash++;
+		if(!*slash || slash - file->name > 155) {
+			fprintf(stderr, "Config file name too long: %s\n", file->name);
+			return -1;
+		}
+		memcpy(hdr + 345, file->name, slash - file->name);
+		name = slash + 1;
+	}
+	memcpy(hdr, name, strlen(name));
+	sprintf((char *)hdr + 100, "%07o", (unsigned int)file->mode);
+	sprintf((char *)hdr + 108, "%07o", 0);
+	sprintf((char *)hdr + 116, "%07o", 0);
+	sprintf((char *)hdr + 124, "%011llo", (unsigned long long)file->data.size);
+	sprintf((char *)hdr + 136, "%011llo", (unsigned long long)file->mtime);
+	hdr[156] = '0';
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	strcpy((char *)hdr + 265, "root");
+	strcpy((char *)hdr + 297, "root");
+
+	/* The checksum is taken with its own field set to spaces */
+	memset(hdr + 148, ' ', 8);
+	for(i = 0; i < TAR_BLOCK; i++)
+		sum += hdr[i];
+	sprintf((char *)hdr + 148, "%06o", sum);
+	hdr[155] = ' ';
+	return 0;
+}
+
+/* Stream the tar archive of the tree through deflate into img */
+static int tree_archive(t_image *img, const t_config_tree *tree) {
+	static const uint8_t zero[TAR_BLOCK * 2];
+	uint8_t hdr[TAR_BLOCK];
+	t_config_gz gz;
+	size_t i;
+	int ret = -1;
+
+	memset(&gz, 0, sizeof(gz));
+	gz.cap = 65536;
+	gz.buf = malloc(gz.cap);
+	if(!gz.buf)
+		return -1;
+	if(deflateInit2(&gz.zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(gz.buf);
+		return -1;
+	}
+
+	for(i = 0; i < tree->count; i++) {
+		const t_config_file *file = &tree->files[i];
+		size_t pad = -file->data.size % TAR_BLOCK;
+
+		if(tar_header(hdr, file) < 0 ||
+		   gz_write(&gz, hdr, TAR_BLOCK, Z_NO_FLUSH) < 0 ||
+		   gz_write(&gz, file->data.data, file->data.size, Z_NO_FLUSH) < 0 ||
+		   gz_write(&gz, zero, pad, Z_NO_FLUSH) < 0)
+			goto out;
+	}
+	if(gz_write(&gz, zero, sizeof(zero), Z_FINISH) < 0)
+		goto out;
+
+	memset(img, 0, sizeof(*img));
+	img->buf = gz.buf;
+	img->data = gz.buf;
+	img->size = gz.zs.total_out;
+	gz.buf = NULL;
+	ret = 0;
+
+out:
+	deflateEnd(&gz.zs);
+	free(gz.buf);
+	return ret;
+}
+
+static int cache_load(t_image *img, const char *filename, uint64_t hash) {
+	uint8_t header[CONFIG_HEADER_LEN];
+	uint8_t trailer[8];
+	const uint8_t *p;
+	uint64_t val, size;
+	FILE *fp;
+
+	fp = fopen(filename, "rb");
+	if(!fp)
+		return -1;
+	memset(img, 0, sizeof(*img));
+
+	if(fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+	   memcmp(header, CONFIG_MAGIC, 8) != 0)
+		goto err;
+	p = file_get_be(header + 8, &val, 4);
+	if(val != CONFIG_VERSION)
+		goto err;
+	p = file_get_be(p, &val, 8);
+	if(val != hash)
+		goto err;
+	file_get_be(p, &size, 4);
+
+	img->buf = malloc(size ? size : 1);
+	if(!img->buf || fread(img->buf, 1, size, fp) != size ||
+	   fread(trailer, 1, sizeof(trailer), fp) != sizeof(trailer))
+		goto err;
+	file_get_be(trailer, &val, 8);
+	if(val != file_hash(file_hash(FILE_HASH_INIT, header, sizeof(header)), img->buf, size))
+		goto err;
+
+	img->data = img->buf;
+	img->size = size;
+	fclose(fp);
+	return 0;
+
+err:
+	image_free(img);
+	fclose(fp);
+	return -1;
+}
+
+typedef struct {
+	const uint8_t *header;
+	const t_image *img;
+	const uint8_t *trailer;
+} t_config_cache;
+
+static int cache_write(FILE *fp, void *arg) {
+	const t_config_cache *c = arg;
+
+	if(fwrite(c->header, 1, CONFIG_HEADER_LEN, fp) != CONFIG_HEADER_LEN ||
+	   fwrite(c->img->data, 1, c->img->size, fp) != c->img->size ||
+	   fwrite(c->trailer, 1, 8, fp) != 8)
+		return -1;
+	return 0;
+}
+
+static int cache_save(const t_image *img, const char *filename, uint64_t hash) {
+	uint8_t header[CONFIG_HEADER_LEN];
+	uint8_t trailer[8];
+	t_config_cache c;
+	uint8_t *p = header;
+
+	memcpy(p, CONFIG_MAGIC, 8);
+	p = file_put_be(p + 8, CONFIG_VERSION, 4);
+	p = file_put_be(p, hash, 8);
+	file_put_be(p, img->size, 4);
+	file_put_be(trailer, file_hash(file_hash(FILE_HASH_INIT, header, sizeof(header)),
+		img->data, img->size), 8);
+
+	c.header = header;
+	c.img = img;
+	c.trailer = trailer;
+	return file_replace(filename, "wb", cache_write, &c);
+}
+
+int config_build(t_image *img, const char *dir, const char *cache) {
+	t_config_tree tree;
+	uint64_t hash;
+	int ret = -1;
+
+	memset(&tree, 0, sizeof(tree));
+	if(tree_scan(&tree, dir, ".") < 0) {
+		fprintf(stderr, "Could not read config directory %s\n", dir);
+		goto out;
+	}
+
+	hash = tree_hash(&tree);
+	if(cache && cache_load(img, cache, hash) == 0) {
+		ret = 1;
+		goto out;
+	}
+
+	if(tree_archive(img, &tree) < 0) {
+		fprintf(stderr, "Could not build the config archive.\n");
+		goto out;
+	}
+	ret = 0;
+	if(cache && cache_save(img, cache, hash) < 0)
+		fprintf(stderr, "Warning: could not write config cache %s\n", cache);
+
+out:
+	tree_free(&tree);
+	return ret;
+}
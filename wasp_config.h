@@ -0,0 +1,35 @@
+/*
+ * Stage 2 config archive built from a directory
+ *
+ * The regular files below the directory are packed into a gzip
+ * compressed ustar archive in memory, with the same "./path" names that
+ * "find . -type f | xargs tar zcf" produces, owned by root and in sorted
+ * order.
+ *
+ * The archive can be cached in a file keyed by a hash over the names,
+ * modes and contents of all files; an unchanged tree then reuses the
+ * cached archive without compressing it again. Cache layout, all fields
+ * big endian:
+ *   char     magic[8]     "WASPCONF"
+ *   uint32_t version
+ *   uint64_t tree_hash    FNV-1a over all files
+ *   uint32_t size         archive size in bytes
+ *   uint8_t  archive[size]
+ *   uint64_t body_hash    FNV-1a of everything above
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_CONFIG_H
+#define WASP_CONFIG_H
+
+#include "wasp_image.h"
+
+#define CONFIG_MAGIC	"WASPCONF"
+#define CONFIG_VERSION	1
+
+/* Returns 1 if the archive came from the cache, 0 if it was built, -1 on error */
+int config_build(t_image *img, const char *dir, const char *cache);
+
+#endif
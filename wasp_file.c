@@ -0,0 +1,70 @@
+/*
+ * Helpers for the small cache files kept between uploads
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wasp_file.h"
+
+uint64_t file_hash(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *p = data;
+	size_t i;
+
+	for(i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+uint8_t *file_put_be(uint8_t *p, uint64_t val, int bytes) {
+	while(bytes--)
+		*p++ = val >> (8 * bytes);
+	return p;
+}
+
+const uint8_t *file_get_be(const uint8_t *p, uint64_t *val, int bytes) {
+	*val = 0;
+	while(bytes--)
+		*val = (*val << 8) | *p++;
+	return p;
+}
+
+int file_replace(const char *filename, const char *mode,
+	int (*write_fn)(FILE *fp, void *arg), void *arg) {
+	char *tmpname;
+	FILE *fp;
+	int err;
+	int ret = -1;
+
+	tmpname = malloc(strlen(filename) + 5);
+	if(!tmpname)
+		return -1;
+	sprintf(tmpname, "%s.tmp", filename);
+	fp = fopen(tmpname, mode);
+	if(!fp)
+		goto out;
+	if(write_fn(fp, arg) < 0 || ferror(fp)) {
+		err = errno;
+		fclose(fp);
+		remove(tmpname);
+		errno = err;
+		goto out;
+	}
+	if(fclose(fp) != 0 || rename(tmpname, filename) != 0) {
+		err = errno;
+		remove(tmpname);
+		errno = err;
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(tmpname);
+	return ret;
+}
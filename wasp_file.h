@@ -0,0 +1,37 @@
+/*
+ * Helpers for the small cache files kept between uploads
+ *
+ * Plans, the config archive cache and the chunk size cache share the
+ * FNV-1a hash, big endian fields and the way they are replaced on disk.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_FILE_H
+#define WASP_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* FNV-1a offset basis, the hash of no data */
+#define FILE_HASH_INIT	0xcbf29ce484222325ull
+
+/* Continue the 64 bit FNV-1a hash over data */
+uint64_t file_hash(uint64_t hash, const void *data, size_t size);
+
+/* Store or fetch the low bytes of val big endian, returns the next byte */
+uint8_t *file_put_be(uint8_t *p, uint64_t val, int bytes);
+const uint8_t *file_get_be(const uint8_t *p, uint64_t *val, int bytes);
+
+/*
+ * Replace filename with what write_fn puts into the stream it is given.
+ * The data goes to a temporary file that is renamed over filename, so a
+ * crash never leaves a torn file behind. write_fn returns -1 on error.
+ * Returns 0 on success, -1 with errno set on error.
+ */
+int file_replace(const char *filename, const char *mode,
+	int (*write_fn)(FILE *fp, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Firmware image loading for the AVM WASP uploaders
+ *
+ * The image is loaded exactly once, either mapped or read into a buffer
+ * that is owned by the image, so size, checksum and upload all see the
+ * same bytes.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wasp_image.h"
+
+static int image_read(t_image *img, int fd, size_t hint) {
+	size_t cap = hint ? hint + 1 : 65536;
+	size_t len = 0;
+	ssize_t n;
+
+	img->buf = malloc(cap);
+	if(!img->buf)
+		return -1;
+
+	for(;;) {
+		if(len == cap) {
+			uint8_t *tmp = realloc(img->buf, cap * 2);
+			if(!tmp)
+				return -1;
+			img->buf = tmp;
+			cap *= 2;
+		}
+		n = read(fd, img->buf + len, cap - len);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0)
+			break;
+		len += n;
+	}
+
+	img->data = img->buf;
+	img->size = len;
+	return 0;
+}
+
+int image_load(t_image *img, const char *filename, int flags) {
+	struct stat st;
+	int fd;
+	int ret = -1;
+
+	memset(img, 0, sizeof(*img));
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return -1;
+
+	if(fstat(fd, &st) < 0)
+		goto out;
+
+	if(S_ISREG(st.st_mode) && st.st_size > 0 && !(flags & IMAGE_COPY)) {
+		img->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(img->map != MAP_FAILED) {
+			img->data = img->map;
+			img->size = st.st_size;
+			ret = 0;
+			goto out;
+		}
+		img->map = NULL;
+	}
+
+	ret = image_read(img, fd, S_ISREG(st.st_mode) ? st.st_size : 0);
+	if(ret < 0)
+		image_free(img);
+
+out:
+	close(fd);
+	return ret;
+}
+
+/* Fault in the pages of a mapped image now instead of during the upload */
+void image_prefault(const t_image *img) {
+	const volatile uint8_t *data = img->data;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if(!img->map)
+		return;
+	madvise(img->map, img->size, MADV_WILLNEED);
+	for(i = 0; i < img->size; i += page)
+		(void)data[i];
+}
+
+void image_free(t_image *img) {
+	if(img->map)
+		munmap(img->map, img->size);
+	free(img->buf);
+	memset(img, 0, sizeof(*img));
+}
@@ -0,0 +1,28 @@
+/*
+ * Firmware image loading for the AVM WASP uploaders
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_IMAGE_H
+#define WASP_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	void *map;		/* mmap()ed file, or NULL */
+	uint8_t *buf;	/* owned copy, or NULL */
+} t_image;
+
+#define IMAGE_MAP	0	/* map the file if possible */
+#define IMAGE_COPY	1	/* read into an owned buffer (snapshot) */
+
+int image_load(t_image *img, const char *filename, int flags);
+void image_prefault(const t_image *img);
+void image_free(t_image *img);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * MDIO transport layer for the AVM WASP stage 1 uploader
+ *
+ * MDIO read/write functions are taken from mdio-tool.c,
+ * Copyright (C) 2013 Pieter Voorthuijsen
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/sockios.h>
+#include <linux/mii.h>
+
+#ifndef __GLIBC__
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#endif
+
+#include "wasp_mdio.h"
+#include "wasp_report.h"
+
+typedef struct {
+	int skfd;		/* AF_INET socket for ioctl() calls. */
+	struct ifreq ifr;
+} t_mdio_ioctl;
+
+static int mdio_ioctl_read(t_mdio *mdio, int location, int *value)
+{
+	t_mdio_ioctl *priv = mdio->priv;
+	struct mii_ioctl_data *mii = (struct mii_ioctl_data *)&priv->ifr.ifr_data;
+	mii->reg_num = location;
+
+	report_syscall(REPORT_SYS_IOCTL);
+	if (ioctl(priv->skfd, SIOCGMIIREG, &priv->ifr) < 0) {
+		fprintf(stderr, "SIOCGMIIREG on %s failed: %s\n", priv->ifr.ifr_name,
+		strerror(errno));
+		return -1;
+	}
+	*value = mii->val_out;
+	return 0;
+}
+
+static int mdio_ioctl_write(t_mdio *mdio, int location, int value)
+{
+	t_mdio_ioctl *priv = mdio->priv;
+	struct mii_ioctl_data *mii = (struct mii_ioctl_data *)&priv->ifr.ifr_data;
+	mii->reg_num = location;
+	mii->val_in = value;
+
+	report_syscall(REPORT_SYS_IOCTL);
+	if (ioctl(priv->skfd, SIOCSMIIREG, &priv->ifr) < 0) {
+		fprintf(stderr, "SIOCSMIIREG on %s failed: %s\n", priv->ifr.ifr_name,
+		strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void mdio_ioctl_close(t_mdio *mdio) {
+	t_mdio_ioctl *priv = mdio->priv;
+
+	close(priv->skfd);
+	free(priv);
+}
+
+static const t_mdio_ops mdio_ioctl_ops = {
+	.name = "ioctl",
+	.read = mdio_ioctl_read,
+	.write = mdio_ioctl_write,
+	.write_batch = NULL,
+	.close = mdio_ioctl_close,
+};
+
+t_mdio *mdio_open_ioctl(const char *iface, int phy_id) {
+	t_mdio *mdio;
+	t_mdio_ioctl *priv;
+	struct mii_ioctl_data *mii;
+
+	mdio = calloc(1, sizeof(*mdio));
+	priv = calloc(1, sizeof(*priv));
+	if(!mdio || !priv) {
+		free(mdio);
+		free(priv);
+		return NULL;
+	}
+
+	/* Open a basic socket. */
+	if ((priv->skfd = socket(AF_INET, SOCK_DGRAM,0)) < 0) {
+		perror("socket");
+		free(mdio);
+		free(priv);
+		return NULL;
+	}
+
+	strncpy(priv->ifr.ifr_name, iface, IFNAMSIZ-1);
+	mii = (struct mii_ioctl_data *)&priv->ifr.ifr_data;
+	mii->phy_id = phy_id;
+
+	mdio->ops = &mdio_ioctl_ops;
+	mdio->priv = priv;
+	mdio_shadow_invalidate(mdio);
+	return mdio;
+}
+
+/*
+ * Parse a transport specification of the form
+ *   ioctl
+ *   sim[,latency=<us>][,turnaround=<us>][,boot=<us>][,rounds=<n>]
+ */
+t_mdio *mdio_open(const char *spec, const char *iface, int phy_id, t_model model) {
+	t_mdio_sim_params params = {
+		.latency_us = 0,
+		.turnaround_us = 50,
+		.boot_us = 50000,
+		.rounds = 2,
+	};
+	char *copy, *tok, *save;
+	t_mdio *mdio = NULL;
+
+	if(!spec || strcmp(spec, "ioctl") == 0) {
+		if(!iface) {
+			fprintf(stderr, "No interface specified.\n");
+			return NULL;
+		}
+		return mdio_open_ioctl(iface, phy_id);
+	}
+
+	if(strncmp(spec, "sim", 3) != 0 || (spec[3] != '\0' && spec[3] != ',')) {
+		fprintf(stderr, "Unknown MDIO transport: %s\n", spec);
+		return NULL;
+	}
+
+	copy = strdup(spec);
+	if(!copy)
+		return NULL;
+	for(tok = strtok_r(copy + 3, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		unsigned int num;
+
+		if(!val) {
+			fprintf(stderr, "Invalid simulator option: %s\n", tok);
+			goto out;
+		}
+		*val++ = '\0';
+		num = strtoul(val, NULL, 0);
+		if(strcmp(tok, "latency") == 0)
+			params.latency_us = num;
+		else if(strcmp(tok, "turnaround") == 0)
+			params.turnaround_us = num;
+		else if(strcmp(tok, "boot") == 0)
+			params.boot_us = num;
+		else if(strcmp(tok, "rounds") == 0)
+			params.rounds = num;
+		else {
+			fprintf(stderr, "Invalid simulator option: %s\n", tok);
+			goto out;
+		}
+	}
+	mdio = mdio_open_sim(model, &params);
+out:
+	free(copy);
+	return mdio;
+}
+
+void mdio_shadow_invalidate(t_mdio *mdio) {
+	int i;
+
+	for(i = 0; i < MDIO_SHADOW_SIZE; i++)
+		mdio->shadow[i].location = -1;
+}
+
+const char *mdio_batch_path(const t_mdio *mdio) {
+	if(!mdio->batch_enabled)
+		return "off";
+	return mdio->ops->write_batch ? "native" : "per-register fallback";
+}
+
+/*
+ * Queue a register write. Cached writes the WASP already holds are
+ * dropped here, so a batch only carries what actually changes.
+ */
+int mdio_batch_write(t_mdio *mdio, int location, int value, int cached) {
+	int slot = (location >> 1) % MDIO_SHADOW_SIZE;
+
+	if(!mdio->batch_enabled || !mdio->ops->write_batch) {
+		if(cached)
+			return mdio_reg_write_cached(mdio, location, value);
+		return mdio_reg_write(mdio, location, value);
+	}
+
+	if(cached && mdio->shadow_enabled && mdio->shadow[slot].location == location &&
+	   mdio->shadow[slot].value == value) {
+		mdio->writes_saved++;
+		return 0;
+	}
+
+	if(mdio->batch_len == MDIO_BATCH_MAX && mdio_batch_submit(mdio) < 0)
+		return -1;
+	mdio->batch[mdio->batch_len].location = location;
+	mdio->batch[mdio->batch_len].value = value;
+	mdio->batch_len++;
+	mdio_shadow_set(mdio, location, value);
+	return 0;
+}
+
+int mdio_batch_submit(t_mdio *mdio) {
+	int count = mdio->batch_len;
+	int i;
+
+	if(!count)
+		return 0;
+
+	mdio->batch_len = 0;
+	mdio->batches++;
+	mdio->writes += count;
+	if(mdio->ops->write_batch(mdio, mdio->batch, count) < 0) {
+		mdio_shadow_invalidate(mdio);
+		return -1;
+	}
+	if(mdio->capture) {
+		for(i = 0; i < count; i++)
+			capture_mdio(mdio->capture, CAPTURE_MDIO_WRITE, CAPTURE_MDIO_BATCH,
+				mdio->batch[i].location, mdio->batch[i].value);
+	}
+	if(mdio->verbose) {
+		for(i = 0; i < count; i++)
+			printf("mdio_write: reg = 0x%x, val = 0x%x (batch)\n",
+				mdio->batch[i].location, mdio->batch[i].value);
+	}
+	return 0;
+}
+
+void mdio_close(t_mdio *mdio) {
+	if(!mdio)
+		return;
+	mdio->ops->close(mdio);
+	free(mdio);
+}
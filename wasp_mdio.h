@@ -0,0 +1,137 @@
+/*
+ * MDIO transport layer for the AVM WASP stage 1 uploader
+ *
+ * A transport moves single 16 bit register accesses to the WASP. The
+ * ioctl transport talks to a real PHY via SIOCGMIIREG/SIOCSMIIREG, the
+ * simulated transport implements the WASP register state machine in
+ * process so the upload can be exercised without hardware.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_MDIO_H
+#define WASP_MDIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wasp_stage1.h"
+#include "wasp_capture.h"
+
+#define MDIO_SHADOW_SIZE	16
+#define MDIO_BATCH_MAX		16
+
+typedef struct t_mdio t_mdio;
+
+typedef struct {
+	int location;
+	int value;
+} t_mdio_op;
+
+typedef struct {
+	const char *name;
+	int (*read)(t_mdio *mdio, int location, int *value);
+	int (*write)(t_mdio *mdio, int location, int value);
+	/* optional: submit several register writes in one transaction */
+	int (*write_batch)(t_mdio *mdio, const t_mdio_op *ops, int count);
+	void (*close)(t_mdio *mdio);
+} t_mdio_ops;
+
+struct t_mdio {
+	const t_mdio_ops *ops;
+	void *priv;
+	int verbose;
+	t_capture *capture;		/* optional, records every access */
+	unsigned long reads;
+	unsigned long writes;
+
+	/*
+	 * Last value known to be held by a register, direct mapped by
+	 * register number. Only the data registers are written through
+	 * mdio_reg_write_cached(), command writes always reach the WASP.
+	 */
+	int shadow_enabled;
+	struct {
+		int location;
+		int value;
+	} shadow[MDIO_SHADOW_SIZE];
+	unsigned long writes_saved;
+
+	/* Writes queued by mdio_batch_write() until mdio_batch_submit() */
+	int batch_enabled;
+	int batch_len;
+	t_mdio_op batch[MDIO_BATCH_MAX];
+	unsigned long batches;
+};
+
+typedef struct {
+	unsigned int latency_us;	/* cost of every register access */
+	unsigned int turnaround_us;	/* time until a command is answered */
+	unsigned int boot_us;		/* time until RESP_READY_TO_START */
+	unsigned int rounds;		/* 3490 post-boot handshake rounds */
+} t_mdio_sim_params;
+
+t_mdio *mdio_open_ioctl(const char *iface, int phy_id);
+t_mdio *mdio_open_sim(t_model model, const t_mdio_sim_params *params);
+t_mdio *mdio_open(const char *spec, const char *iface, int phy_id, t_model model);
+void mdio_close(t_mdio *mdio);
+void mdio_shadow_invalidate(t_mdio *mdio);
+int mdio_batch_write(t_mdio *mdio, int location, int value, int cached);
+int mdio_batch_submit(t_mdio *mdio);
+const char *mdio_batch_path(const t_mdio *mdio);
+
+static inline void mdio_shadow_set(t_mdio *mdio, int location, int value) {
+	int slot = (location >> 1) % MDIO_SHADOW_SIZE;
+
+	mdio->shadow[slot].location = location;
+	mdio->shadow[slot].value = value;
+}
+
+static inline int mdio_reg_read(t_mdio *mdio, int location, int *value) {
+	mdio->reads++;
+	if(mdio->ops->read(mdio, location, value) < 0)
+		return -1;
+	mdio_shadow_set(mdio, location, *value);
+	if(mdio->capture)
+		capture_mdio(mdio->capture, CAPTURE_MDIO_READ, 0, location, *value);
+	if(mdio->verbose)
+		printf("mdio_read: reg = 0x%x, val = 0x%x\n", location, *value);
+	return 0;
+}
+
+static inline int mdio_reg_write(t_mdio *mdio, int location, int value) {
+	mdio->writes++;
+	if(mdio->ops->write(mdio, location, value) < 0) {
+		mdio_shadow_invalidate(mdio);
+		return -1;
+	}
+	mdio_shadow_set(mdio, location, value);
+	if(mdio->capture)
+		capture_mdio(mdio->capture, CAPTURE_MDIO_WRITE, 0, location, value);
+	if(mdio->verbose)
+		printf("mdio_write: reg = 0x%x, val = 0x%x\n", location, value);
+	return 0;
+}
+
+/* Skip the write if the register is known to hold the value already */
+static inline int mdio_reg_write_cached(t_mdio *mdio, int location, int value) {
+	int slot = (location >> 1) % MDIO_SHADOW_SIZE;
+
+	if(mdio->shadow_enabled && mdio->shadow[slot].location == location &&
+	   mdio->shadow[slot].value == value) {
+		mdio->writes_saved++;
+		return 0;
+	}
+	return mdio_reg_write(mdio, location, value);
+}
+
+static inline uint64_t mdio_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * Simulated AVM WASP for the stage 1 uploader
+ *
+ * Implements the stage 1 register state machine of the 3390 and 3490
+ * as observed on the MDIO bus: commands written to the status register
+ * are answered after a configurable turnaround, the uploaded image is
+ * reassembled and verified against the header and checksum, and the
+ * post-upload boot handshake is played back.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wasp_mdio.h"
+#include "wasp_checksum.h"
+
+#define SIM_REG_COUNT	(REG_STATUS_3390 + 0x10)
+
+typedef enum {
+	SIM_STATE_LOADING,
+	SIM_STATE_BOOTING,
+	SIM_STATE_READY,
+	SIM_STATE_WAIT_MAC,
+	SIM_STATE_HANDSHAKE,
+	SIM_STATE_RUNNING,
+	SIM_STATE_FAILED
+} t_sim_state;
+
+typedef struct {
+	t_model model;
+	t_mdio_sim_params params;
+	t_sim_state state;
+
+	uint16_t regs[SIM_REG_COUNT];
+	uint16_t reg_status;
+	uint16_t cmd_set_checksum;
+	uint16_t cmd_start_firmware;
+
+	/* response that becomes visible once ready_at has passed */
+	int pending;
+	uint16_t pending_status;
+	uint64_t ready_at;
+
+	uint32_t start_addr;
+	uint32_t len;
+	uint32_t exec_addr;
+	uint32_t checksum;
+	uint8_t *image;
+	uint32_t received;
+	unsigned int round;
+} t_mdio_sim;
+
+static void sim_delay(uint64_t ns) {
+	uint64_t until;
+
+	if(!ns)
+		return;
+	/* MDIO accesses are in the microsecond range, usleep() is too coarse */
+	until = mdio_now_ns() + ns;
+	while(mdio_now_ns() < until)
+		;
+}
+
+static void sim_respond(t_mdio_sim *sim, uint16_t status, unsigned int delay_us) {
+	sim->pending = 1;
+	sim->pending_status = status;
+	sim->ready_at = mdio_now_ns() + (uint64_t)delay_us * 1000;
+}
+
+static void sim_update(t_mdio_sim *sim) {
+	if(sim->pending && mdio_now_ns() >= sim->ready_at) {
+		sim->regs[sim->reg_status] = sim->pending_status;
+		if(sim->model == MODEL_3390)
+			sim->regs[REG_ZERO] = sim->pending_status;
+		sim->pending = 0;
+	}
+}
+
+static uint16_t sim_data(t_mdio_sim *sim, int n) {
+	return sim->regs[REG_DATA(sim->reg_status, n)];
+}
+
+static void sim_fail(t_mdio_sim *sim, const char *msg) {
+	fprintf(stderr, "sim: %s\n", msg);
+	sim->state = SIM_STATE_FAILED;
+	sim_respond(sim, RESP_RETRY, sim->params.turnaround_us);
+}
+
+static void sim_set_data(t_mdio_sim *sim) {
+	uint32_t n;
+	int i;
+
+	if(!sim->image) {
+		sim_fail(sim, "data before parameters");
+		return;
+	}
+	n = sim->len - sim->received;
+	if(n == 0) {
+		sim_fail(sim, "data beyond announced length");
+		return;
+	}
+	if(n > CHUNK_SIZE)
+		n = CHUNK_SIZE;
+	for(i = 0; i < CHUNK_SIZE / 2 && (uint32_t)(2 * i) < n; i++) {
+		uint16_t val = sim_data(sim, i + 1);
+		/* A lone trailing byte is sent in the low half of the register */
+		if((uint32_t)(2 * i + 1) < n) {
+			sim->image[sim->received + 2 * i] = val >> 8;
+			sim->image[sim->received + 2 * i + 1] = val & 0xff;
+		} else {
+			sim->image[sim->received + 2 * i] = val & 0xff;
+		}
+	}
+	sim->received += n;
+	sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+}
+
+static void sim_command(t_mdio_sim *sim, uint16_t cmd) {
+	/* The register keeps the command until the WASP has processed it */
+	sim->regs[sim->reg_status] = cmd;
+	if(sim->model == MODEL_3390)
+		sim->regs[REG_ZERO] = RESP_WAIT;
+
+	switch(sim->state) {
+	case SIM_STATE_LOADING:
+		if(cmd == CMD_SET_PARAMS) {
+			sim->start_addr = (uint32_t)sim_data(sim, 1) << 16 | sim_data(sim, 2);
+			sim->len = (uint32_t)sim_data(sim, 3) << 16 | sim_data(sim, 4);
+			sim->exec_addr = (uint32_t)sim_data(sim, 5) << 16 | sim_data(sim, 6);
+			free(sim->image);
+			sim->image = calloc(1, sim->len ? sim->len : 1);
+			sim->received = 0;
+			sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+		} else if(cmd == sim->cmd_set_checksum) {
+			sim->checksum = (uint32_t)sim_data(sim, 1) << 16 | sim_data(sim, 2);
+			sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+		} else if(cmd == CMD_SET_DATA) {
+			sim_set_data(sim);
+		} else if(cmd == sim->cmd_start_firmware) {
+			if(!sim->image || sim->received != sim->len) {
+				sim_fail(sim, "start before the image was complete");
+			} else if(wasp_checksum(sim->image, sim->len) != sim->checksum) {
+				sim_fail(sim, "checksum mismatch");
+			} else {
+				sim->state = SIM_STATE_BOOTING;
+				sim_respond(sim, RESP_READY_TO_START, sim->params.boot_us);
+			}
+		} else {
+			sim_fail(sim, "unexpected command while loading");
+		}
+		break;
+
+	case SIM_STATE_BOOTING:
+	case SIM_STATE_READY:
+		if(sim->model == MODEL_3390 && cmd == CMD_START_FIRMWARE_3390) {
+			sim->state = SIM_STATE_WAIT_MAC;
+			sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+		} else if(sim->model == MODEL_3490 && cmd == CMD_SET_CHECKSUM_3490) {
+			sim->state = SIM_STATE_HANDSHAKE;
+			sim->round = 0;
+			sim->regs[REG_DATA(sim->reg_status, 1)] = 0;
+			sim->regs[REG_DATA(sim->reg_status, 2)] = sim->params.rounds;
+			sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+		} else {
+			sim_fail(sim, "unexpected command while booting");
+		}
+		break;
+
+	case SIM_STATE_WAIT_MAC:
+		if(cmd == CMD_SET_DATA) {
+			sim->state = SIM_STATE_RUNNING;
+			sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+		} else {
+			sim_fail(sim, "expected MAC address");
+		}
+		break;
+
+	case SIM_STATE_HANDSHAKE:
+		if(cmd == CMD_SET_CHECKSUM_3490) {
+			sim->round++;
+			sim->regs[REG_DATA(sim->reg_status, 1)] = 1;
+			sim->regs[REG_DATA(sim->reg_status, 2)] = 0;
+			sim_respond(sim, RESP_OK, sim->params.turnaround_us);
+		} else if(cmd == CMD_START_FIRMWARE2_3490 && sim->round > sim->params.rounds) {
+			sim->state = SIM_STATE_RUNNING;
+			sim->regs[sim->reg_status] = RESP_OK;
+			sim->pending = 0;
+		} else {
+			sim_fail(sim, "unexpected command during handshake");
+		}
+		break;
+
+	case SIM_STATE_RUNNING:
+	case SIM_STATE_FAILED:
+		sim_fail(sim, "command after firmware start");
+		break;
+	}
+}
+
+static int mdio_sim_read(t_mdio *mdio, int location, int *value) {
+	t_mdio_sim *sim = mdio->priv;
+
+	sim_delay((uint64_t)sim->params.latency_us * 1000);
+	if(location < 0 || location >= SIM_REG_COUNT)
+		return -1;
+
+	sim_update(sim);
+	if(sim->state == SIM_STATE_BOOTING && !sim->pending)
+		sim->state = SIM_STATE_READY;
+	*value = sim->regs[location];
+	return 0;
+}
+
+static int mdio_sim_write(t_mdio *mdio, int location, int value) {
+	t_mdio_sim *sim = mdio->priv;
+
+	sim_delay((uint64_t)sim->params.latency_us * 1000);
+	if(location < 0 || location >= SIM_REG_COUNT)
+		return -1;
+
+	sim_update(sim);
+	if(location == sim->reg_status)
+		sim_command(sim, value & 0xffff);
+	else
+		sim->regs[location] = value & 0xffff;
+	return 0;
+}
+
+/* A batch models a kernel side burst: one access latency for all writes */
+static int mdio_sim_write_batch(t_mdio *mdio, const t_mdio_op *ops, int count) {
+	t_mdio_sim *sim = mdio->priv;
+	int i;
+
+	sim_delay((uint64_t)sim->params.latency_us * 1000);
+	for(i = 0; i < count; i++) {
+		if(ops[i].location < 0 || ops[i].location >= SIM_REG_COUNT)
+			return -1;
+		sim_update(sim);
+		if(ops[i].location == sim->reg_status)
+			sim_command(sim, ops[i].value & 0xffff);
+		else
+			sim->regs[ops[i].location] = ops[i].value & 0xffff;
+	}
+	return 0;
+}
+
+static void mdio_sim_close(t_mdio *mdio) {
+	t_mdio_sim *sim = mdio->priv;
+
+	if(sim->state != SIM_STATE_RUNNING)
+		fprintf(stderr, "sim: WASP firmware was not started\n");
+	free(sim->image);
+	free(sim);
+}
+
+static const t_mdio_ops mdio_sim_ops = {
+	.name = "sim",
+	.read = mdio_sim_read,
+	.write = mdio_sim_write,
+	.write_batch = mdio_sim_write_batch,
+	.close = mdio_sim_close,
+};
+
+t_mdio *mdio_open_sim(t_model model, const t_mdio_sim_params *params) {
+	t_mdio *mdio;
+	t_mdio_sim *sim;
+
+	if(model != MODEL_3390 && model != MODEL_3490)
+		return NULL;
+
+	mdio = calloc(1, sizeof(*mdio));
+	sim = calloc(1, sizeof(*sim));
+	if(!mdio || !sim) {
+		free(mdio);
+		free(sim);
+		return NULL;
+	}
+
+	sim->model = model;
+	sim->params = *params;
+	sim->state = SIM_STATE_LOADING;
+	if(model == MODEL_3390) {
+		sim->reg_status = REG_STATUS_3390;
+		sim->cmd_set_checksum = CMD_SET_CHECKSUM_3390;
+		sim->cmd_start_firmware = CMD_START_FIRMWARE_3390;
+	} else {
+		sim->reg_status = REG_STATUS_3490;
+		sim->cmd_set_checksum = CMD_SET_CHECKSUM_3490;
+		sim->cmd_start_firmware = CMD_START_FIRMWARE_3490;
+	}
+	sim->regs[sim->reg_status] = RESP_OK;
+	sim->regs[REG_ZERO] = RESP_OK;
+
+	mdio->ops = &mdio_sim_ops;
+	mdio->priv = sim;
+	mdio_shadow_invalidate(mdio);
+	return mdio;
+}
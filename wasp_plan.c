@@ -0,0 +1,196 @@
+/*
+ * Precompiled stage 1 upload plans for AVM WASP
+ *
+ * File layout, all fields big endian:
+ *   char     magic[8]     "WASPPLAN"
+ *   uint32_t version
+ *   uint32_t model
+ *   uint32_t size         image size in bytes
+ *   uint64_t hash         FNV-1a of the image
+ *   uint32_t checksum
+ *   uint32_t start_addr
+ *   uint32_t exec_addr
+ *   uint32_t chunks
+ *   uint16_t regs[chunks][7]
+ *   uint64_t body_hash    FNV-1a of everything above
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wasp_plan.h"
+#include "wasp_checksum.h"
+#include "wasp_file.h"
+
+#define PLAN_HEADER_LEN	(8 + 3 * 4 + 8 + 4 * 4)
+
+uint64_t plan_hash(const uint8_t *data, size_t size) {
+	return file_hash(FILE_HASH_INIT, data, size);
+}
+
+typedef struct {
+	const uint8_t *buf;
+	size_t len;
+} t_plan_buf;
+
+static int plan_write(FILE *fp, void *arg) {
+	const t_plan_buf *b = arg;
+
+	return fwrite(b->buf, 1, b->len, fp) == b->len ? 0 : -1;
+}
+
+int plan_compile(t_plan *plan, t_model model, const uint8_t *data, size_t size,
+	uint32_t start_addr, uint32_t exec_addr) {
+	uint32_t chunk;
+
+	memset(plan, 0, sizeof(*plan));
+	if(size == 0 || size > 0xffff)
+		return -1;
+
+	plan->model = model;
+	plan->size = size;
+	plan->hash = plan_hash(data, size);
+	plan->checksum = wasp_checksum(data, size);
+	plan->start_addr = start_addr;
+	plan->exec_addr = exec_addr;
+	plan->chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	plan->regs = calloc(plan->chunks, sizeof(*plan->regs));
+	if(!plan->regs)
+		return -1;
+
+	for(chunk = 0; chunk < plan->chunks; chunk++) {
+		const uint8_t *p = data + chunk * CHUNK_SIZE;
+		size_t len = size - chunk * CHUNK_SIZE;
+		size_t i;
+
+		if(len > CHUNK_SIZE)
+			len = CHUNK_SIZE;
+		/* A lone trailing byte goes into the low half, as write_chunk() does */
+		for(i = 0; i < len; i += 2) {
+			if(i + 1 < len)
+				plan->regs[chunk][i / 2] = p[i] << 8 | p[i + 1];
+			else
+				plan->regs[chunk][i / 2] = p[i];
+		}
+	}
+	return 0;
+}
+
+int plan_save(const t_plan *plan, const char *filename) {
+	size_t len = PLAN_HEADER_LEN + plan->chunks * CHUNK_SIZE + 8;
+	t_plan_buf out;
+	uint8_t *buf, *p;
+	uint32_t chunk;
+	int i;
+	int ret;
+
+	buf = malloc(len);
+	if(!buf)
+		return -1;
+
+	p = buf;
+	memcpy(p, PLAN_MAGIC, 8);
+	p += 8;
+	p = file_put_be(p, PLAN_VERSION, 4);
+	p = file_put_be(p, plan->model, 4);
+	p = file_put_be(p, plan->size, 4);
+	p = file_put_be(p, plan->hash, 8);
+	p = file_put_be(p, plan->checksum, 4);
+	p = file_put_be(p, plan->start_addr, 4);
+	p = file_put_be(p, plan->exec_addr, 4);
+	p = file_put_be(p, plan->chunks, 4);
+	for(chunk = 0; chunk < plan->chunks; chunk++)
+		for(i = 0; i < PLAN_REGS; i++)
+			p = file_put_be(p, plan->regs[chunk][i], 2);
+	file_put_be(p, plan_hash(buf, p - buf), 8);
+
+	out.buf = buf;
+	out.len = len;
+	ret = file_replace(filename, "wb", plan_write, &out);
+	free(buf);
+	return ret;
+}
+
+int plan_load(t_plan *plan, const char *filename) {
+	uint8_t header[PLAN_HEADER_LEN];
+	uint8_t *body = NULL;
+	const uint8_t *p;
+	uint64_t val, hash;
+	size_t body_len;
+	uint32_t chunk;
+	FILE *fp;
+	int i;
+
+	memset(plan, 0, sizeof(*plan));
+	fp = fopen(filename, "rb");
+	if(!fp)
+		return -1;
+
+	if(fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+	   memcmp(header, PLAN_MAGIC, 8) != 0)
+		goto err;
+
+	p = file_get_be(header + 8, &val, 4);
+	if(val != PLAN_VERSION)
+		goto err;
+	p = file_get_be(p, &val, 4);
+	plan->model = val;
+	p = file_get_be(p, &val, 4);
+	plan->size = val;
+	p = file_get_be(p, &plan->hash, 8);
+	p = file_get_be(p, &val, 4);
+	plan->checksum = val;
+	p = file_get_be(p, &val, 4);
+	plan->start_addr = val;
+	p = file_get_be(p, &val, 4);
+	plan->exec_addr = val;
+	p = file_get_be(p, &val, 4);
+	plan->chunks = val;
+
+	if(plan->size == 0 || plan->size > 0xffff ||
+	   plan->chunks != (plan->size + CHUNK_SIZE - 1) / CHUNK_SIZE)
+		goto err;
+
+	body_len = plan->chunks * CHUNK_SIZE + 8;
+	body = malloc(body_len);
+	plan->regs = calloc(plan->chunks, sizeof(*plan->regs));
+	if(!body || !plan->regs || fread(body, 1, body_len, fp) != body_len)
+		goto err;
+
+	hash = file_hash(plan_hash(header, sizeof(header)), body, body_len - 8);
+	file_get_be(body + body_len - 8, &val, 8);
+	if(hash != val)
+		goto err;
+
+	p = body;
+	for(chunk = 0; chunk < plan->chunks; chunk++) {
+		for(i = 0; i < PLAN_REGS; i++) {
+			p = file_get_be(p, &val, 2);
+			plan->regs[chunk][i] = val;
+		}
+	}
+
+	free(body);
+	fclose(fp);
+	return 0;
+
+err:
+	free(body);
+	plan_free(plan);
+	fclose(fp);
+	return -1;
+}
+
+int plan_matches(const t_plan *plan, t_model model, const uint8_t *data, size_t size) {
+	return plan->regs && plan->model == model && plan->size == size &&
+		plan->hash == plan_hash(data, size);
+}
+
+void plan_free(t_plan *plan) {
+	free(plan->regs);
+	memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,54 @@
+/*
+ * Precompiled stage 1 upload plans for AVM WASP
+ *
+ * A plan holds everything stage 1 writes to the WASP for one image and
+ * model: the header and checksum words and the seven data register
+ * values of every chunk. Plans are stored in a small binary file keyed
+ * by a hash of the image, so an unchanged image can be replayed as a
+ * plain table walk.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_PLAN_H
+#define WASP_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wasp_stage1.h"
+
+#define PLAN_MAGIC		"WASPPLAN"
+#define PLAN_VERSION	1
+#define PLAN_REGS		(CHUNK_SIZE / 2)
+
+typedef struct t_plan {
+	t_model model;
+	uint32_t size;
+	uint64_t hash;
+	uint32_t checksum;
+	uint32_t start_addr;
+	uint32_t exec_addr;
+	uint32_t chunks;
+	uint16_t (*regs)[PLAN_REGS];
+} t_plan;
+
+uint64_t plan_hash(const uint8_t *data, size_t size);
+int plan_compile(t_plan *plan, t_model model, const uint8_t *data, size_t size,
+	uint32_t start_addr, uint32_t exec_addr);
+int plan_load(t_plan *plan, const char *filename);
+int plan_save(const t_plan *plan, const char *filename);
+int plan_matches(const t_plan *plan, t_model model, const uint8_t *data, size_t size);
+void plan_free(t_plan *plan);
+
+/* Number of data registers carrying image bytes in the given chunk */
+static inline int plan_chunk_regs(const t_plan *plan, uint32_t chunk) {
+	uint32_t left = plan->size - chunk * CHUNK_SIZE;
+
+	if(left >= CHUNK_SIZE)
+		return PLAN_REGS;
+	return (left + 1) / 2;
+}
+
+#endif
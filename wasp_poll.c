@@ -0,0 +1,125 @@
+/*
+ * Completion polling for the AVM WASP stage 1 uploader
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+#include "wasp_poll.h"
+#include "wasp_report.h"
+
+int poll_parse_mode(const char *name, t_poll_mode *mode) {
+	if(strcmp(name, "fixed") == 0)
+		*mode = POLL_MODE_FIXED;
+	else if(strcmp(name, "adaptive") == 0)
+		*mode = POLL_MODE_ADAPTIVE;
+	else
+		return -1;
+	return 0;
+}
+
+const char *poll_mode_name(t_poll_mode mode) {
+	return mode == POLL_MODE_ADAPTIVE ? "adaptive" : "fixed";
+}
+
+void poll_init(t_poll *poll, t_poll_mode mode) {
+	memset(poll, 0, sizeof(*poll));
+	poll->mode = mode;
+	/* The default 50us timer slack would swallow the short sleeps */
+	if(mode == POLL_MODE_ADAPTIVE)
+		prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+static void poll_sleep(unsigned int us) {
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	report_syscall(REPORT_SYS_NANOSLEEP);
+	nanosleep(&ts, NULL);
+}
+
+static void ewma_update(unsigned int *avg16, unsigned int sample) {
+	int diff = (int)(sample << 4) - (int)*avg16;
+
+	*avg16 += diff / 8;
+}
+
+static int poll_wait_fixed(t_poll *poll, t_mdio *mdio, int location, int expected, int *value) {
+	int timeout = MDIO_TIMEOUT_COUNT;
+
+	do {
+		usleep(POLL_SLEEP_US);
+		report_syscall(REPORT_SYS_NANOSLEEP);
+		poll->sleeps++;
+		poll->polls++;
+		if(mdio_reg_read(mdio, location, value) < 0)
+			return POLL_ERROR;
+		timeout--;
+	} while((*value != expected) && (timeout > 0));
+
+	return (*value == expected) ? 0 : POLL_TIMEOUT;
+}
+
+static int poll_wait_adaptive(t_poll *poll, t_mdio *mdio, int location, int expected, int *value) {
+	uint64_t start = mdio_now_ns();
+	uint64_t deadline = start + (uint64_t)POLL_TIMEOUT_US * 1000;
+	/*
+	 * Aim slightly below the learned turnaround, otherwise the estimate
+	 * could only ever grow by the sleep overshoot.
+	 */
+	unsigned int delay = (poll->ewma_us16 >> 4) * 3 / 4;
+	unsigned int polls = 0;
+
+	if(delay < POLL_MIN_DELAY_US)
+		delay = POLL_MIN_DELAY_US;
+
+	for(;;) {
+		polls++;
+		if(mdio_reg_read(mdio, location, value) < 0)
+			return POLL_ERROR;
+		if(*value == expected)
+			break;
+		if(mdio_now_ns() >= deadline)
+			break;
+		poll_sleep(delay);
+		poll->sleeps++;
+		delay *= 2;
+		if(delay > POLL_MAX_DELAY_US)
+			delay = POLL_MAX_DELAY_US;
+	}
+	poll->polls += polls;
+
+	if(*value != expected)
+		return POLL_TIMEOUT;
+
+	/* Only waits that actually found the WASP busy tell us its turnaround */
+	if(polls > 1)
+		ewma_update(&poll->ewma_us16, (mdio_now_ns() - start) / 1000);
+	ewma_update(&poll->ewma_polls16, polls);
+	return 0;
+}
+
+/*
+ * Poll the register at location until it reads expected. The last value
+ * read is returned in value even on timeout, callers may accept other
+ * responses. Returns 0, POLL_TIMEOUT or POLL_ERROR if a read failed, in
+ * which case value is not valid.
+ */
+int poll_wait(t_poll *poll, t_mdio *mdio, int location, int expected, int *value) {
+	int ret;
+
+	poll->waits++;
+	if(poll->mode == POLL_MODE_ADAPTIVE)
+		ret = poll_wait_adaptive(poll, mdio, location, expected, value);
+	else
+		ret = poll_wait_fixed(poll, mdio, location, expected, value);
+	if(ret == POLL_TIMEOUT)
+		poll->timeouts++;
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Completion polling for the AVM WASP stage 1 uploader
+ *
+ * After a command has been written to the status register the WASP
+ * needs some time before it answers. The fixed strategy sleeps
+ * POLL_SLEEP_US before every read, as the uploader always did. The
+ * adaptive strategy reads immediately, then sleeps for the learned
+ * turnaround and backs off exponentially while the WASP is still busy.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_POLL_H
+#define WASP_POLL_H
+
+#include "wasp_mdio.h"
+
+#define POLL_SLEEP_US		100
+#define POLL_MIN_DELAY_US	2
+#define POLL_MAX_DELAY_US	2000
+// Same overall budget as MDIO_TIMEOUT_COUNT fixed polls
+#define POLL_TIMEOUT_US		(MDIO_TIMEOUT_COUNT * POLL_SLEEP_US)
+
+/* poll_wait() results besides 0 */
+#define POLL_TIMEOUT		-1
+#define POLL_ERROR			-2
+
+typedef enum {
+	POLL_MODE_FIXED,
+	POLL_MODE_ADAPTIVE
+} t_poll_mode;
+
+typedef struct {
+	t_poll_mode mode;
+	/* EWMA of the observed turnaround and poll count, in 1/16 units */
+	unsigned int ewma_us16;
+	unsigned int ewma_polls16;
+	unsigned long waits;
+	unsigned long polls;
+	unsigned long sleeps;
+	unsigned long timeouts;
+} t_poll;
+
+int poll_parse_mode(const char *name, t_poll_mode *mode);
+const char *poll_mode_name(t_poll_mode mode);
+void poll_init(t_poll *poll, t_poll_mode mode);
+int poll_wait(t_poll *poll, t_mdio *mdio, int location, int expected, int *value);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Per-phase timing report for the AVM WASP uploaders
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "wasp_report.h"
+
+unsigned long report_syscalls[REPORT_SYS_COUNT];
+
+static const char *const syscall_names[REPORT_SYS_COUNT] = {
+	[REPORT_SYS_IOCTL] = "ioctl",
+	[REPORT_SYS_NANOSLEEP] = "nanosleep",
+	[REPORT_SYS_POLL] = "poll",
+	[REPORT_SYS_SEND] = "send",
+	[REPORT_SYS_RECV] = "recv",
+};
+
+static uint64_t report_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t tv_us(const struct timeval *tv) {
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/*
+ * Take a snapshot of all counters. A phase holds the snapshot from its
+ * start until it ends, then the differences.
+ */
+static void snapshot(t_report *report, t_report_phase *phase, int sign) {
+	struct rusage ru;
+	int i;
+
+	getrusage(RUSAGE_SELF, &ru);
+	phase->user_us = tv_us(&ru.ru_utime) - phase->user_us * sign;
+	phase->sys_us = tv_us(&ru.ru_stime) - phase->sys_us * sign;
+	phase->vcsw = ru.ru_nvcsw - phase->vcsw * sign;
+	phase->ivcsw = ru.ru_nivcsw - phase->ivcsw * sign;
+	phase->polls = (report->polls ? report->polls() : 0) - phase->polls * sign;
+	for(i = 0; i < REPORT_SYS_COUNT; i++)
+		phase->syscalls[i] = __atomic_load_n(&report_syscalls[i], __ATOMIC_RELAXED) -
+			phase->syscalls[i] * sign;
+}
+
+void report_init(t_report *report, const char *tool, int enabled) {
+	memset(report, 0, sizeof(*report));
+	report->enabled = enabled;
+	report->tool = tool;
+	report->start_ns = report_now_ns();
+}
+
+/* Start a new phase, ending the current one */
+void report_begin(t_report *report, const char *name) {
+	t_report_phase *phase;
+
+	if(!report->enabled)
+		return;
+	report_end(report);
+	if(report->num_phases == REPORT_MAX_PHASES)
+		return;
+
+	phase = &report->phases[report->num_phases++];
+	memset(phase, 0, sizeof(*phase));
+	phase->name = name;
+	snapshot(report, phase, 0);
+	phase->start_ns = report_now_ns();
+	report->open = 1;
+}
+
+void report_end(t_report *report) {
+	t_report_phase *phase;
+
+	if(!report->enabled || !report->open)
+		return;
+
+	phase = &report->phases[report->num_phases - 1];
+	phase->end_ns = report_now_ns();
+	snapshot(report, phase, 1);
+	report->open = 0;
+}
+
+void report_rtt(t_report *report, uint64_t rtt_ns) {
+	uint64_t us = rtt_ns / 1000;
+	int bucket = 0;
+
+	if(!report->enabled)
+		return;
+
+	while(bucket < REPORT_RTT_BUCKETS - 1 && us >= (1ull << bucket))
+		bucket++;
+	report->rtt[bucket]++;
+	if(!report->rtt_count || us < report->rtt_min_us)
+		report->rtt_min_us = us;
+	if(us > report->rtt_max_us)
+		report->rtt_max_us = us;
+	report->rtt_sum_us += us;
+	report->rtt_count++;
+}
+
+/* Write the report as JSON, "-" writes to stdout */
+int report_write(t_report *report, const char *filename) {
+	FILE *fp;
+	int i, j;
+
+	if(!report->enabled)
+		return 0;
+	report_end(report);
+
+	fp = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+	if(!fp) {
+		perror(filename);
+		return -1;
+	}
+
+	fprintf(fp, "{\n  \"tool\": \"%s\",\n", report->tool);
+	/* getrusage(RUSAGE_SELF), summed over all threads */
+	fprintf(fp, "  \"rusage\": \"process\",\n");
+	fprintf(fp, "  \"total_us\": %llu,\n",
+		(unsigned long long)(report_now_ns() - report->start_ns) / 1000);
+	fprintf(fp, "  \"phases\": [");
+	for(i = 0; i < report->num_phases; i++) {
+		const t_report_phase *phase = &report->phases[i];
+
+		fprintf(fp, "%s\n    {\"name\": \"%s\", \"start_us\": %llu, \"duration_us\": %llu, "
+			"\"user_us\": %llu, \"sys_us\": %llu, \"vcsw\": %ld, \"ivcsw\": %ld, "
+			"\"polls\": %lu, \"syscalls\": {",
+			i ? "," : "", phase->name,
+			(unsigned long long)(phase->start_ns - report->start_ns) / 1000,
+			(unsigned long long)(phase->end_ns - phase->start_ns) / 1000,
+			(unsigned long long)phase->user_us, (unsigned long long)phase->sys_us,
+			phase->vcsw, phase->ivcsw, phase->polls);
+		for(j = 0; j < REPORT_SYS_COUNT; j++)
+			fprintf(fp, "%s\"%s\": %lu", j ? ", " : "", syscall_names[j], phase->syscalls[j]);
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "\n  ]");
+
+	if(report->rtt_count) {
+		int first = 1;
+
+		fprintf(fp, ",\n  \"ack_rtt_us\": {\"count\": %lu, \"min\": %llu, \"mean\": %llu, \"max\": %llu, "
+			"\"histogram\": [", report->rtt_count,
+			(unsigned long long)report->rtt_min_us,
+			(unsigned long long)(report->rtt_sum_us / report->rtt_count),
+			(unsigned long long)report->rtt_max_us);
+		for(i = 0; i < REPORT_RTT_BUCKETS; i++) {
+			if(!report->rtt[i])
+				continue;
+			/* The last bucket collects everything above */
+			if(i == REPORT_RTT_BUCKETS - 1)
+				fprintf(fp, "%s{\"lt\": null, \"count\": %lu}", first ? "" : ", ", report->rtt[i]);
+			else
+				fprintf(fp, "%s{\"lt\": %llu, \"count\": %lu}", first ? "" : ", ",
+					1ull << i, report->rtt[i]);
+			first = 0;
+		}
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "\n}\n");
+
+	if(fp != stdout)
+		fclose(fp);
+	return 0;
+}
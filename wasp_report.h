@@ -0,0 +1,80 @@
+/*
+ * Per-phase timing report for the AVM WASP uploaders
+ *
+ * An upload is split into named phases. For every phase the wall clock
+ * time, the CPU time and context switches from getrusage(), the number
+ * of polls and the system calls issued by the uploader itself are
+ * recorded. Stage 2 adds a histogram of ACK round trip times. The
+ * report is written as JSON at the end.
+ *
+ * The CPU time and context switches are those of the whole process, of
+ * all threads: the device threads of a parallel stage 1, the stage 2
+ * decompression, and in the combined uploader stage 2 being prepared
+ * while stage 1 runs. The report says so with "rusage": "process".
+ *
+ * System calls are counted at the call sites with report_syscall(),
+ * which is always on and costs an atomic increment, as several threads
+ * issue them at once.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_REPORT_H
+#define WASP_REPORT_H
+
+#include <stdint.h>
+
+#define REPORT_MAX_PHASES	16
+#define REPORT_RTT_BUCKETS	25	/* powers of two up to 2^24 us */
+
+typedef enum {
+	REPORT_SYS_IOCTL,
+	REPORT_SYS_NANOSLEEP,
+	REPORT_SYS_POLL,
+	REPORT_SYS_SEND,
+	REPORT_SYS_RECV,
+	REPORT_SYS_COUNT
+} t_report_sys;
+
+typedef struct {
+	const char *name;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t user_us;
+	uint64_t sys_us;
+	long vcsw;
+	long ivcsw;
+	unsigned long polls;
+	unsigned long syscalls[REPORT_SYS_COUNT];
+} t_report_phase;
+
+typedef struct {
+	int enabled;
+	const char *tool;
+	uint64_t start_ns;
+	/* Number of polls so far, sampled at phase boundaries */
+	unsigned long (*polls)(void);
+	t_report_phase phases[REPORT_MAX_PHASES];
+	int num_phases;
+	int open;
+	unsigned long rtt[REPORT_RTT_BUCKETS];
+	unsigned long rtt_count;
+	uint64_t rtt_sum_us;
+	uint64_t rtt_min_us;
+	uint64_t rtt_max_us;
+} t_report;
+
+extern unsigned long report_syscalls[REPORT_SYS_COUNT];
+
+static inline void report_syscall(t_report_sys sys) {
+	__atomic_fetch_add(&report_syscalls[sys], 1, __ATOMIC_RELAXED);
+}
+
+void report_init(t_report *report, const char *tool, int enabled);
+void report_begin(t_report *report, const char *name);
+void report_end(t_report *report);
+void report_rtt(t_report *report, uint64_t rtt_ns);
+int report_write(t_report *report, const char *filename);
+
+#endif
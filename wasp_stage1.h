@@ -0,0 +1,48 @@
+/*
+ * Stage 1 (MDIO) protocol definitions for AVM WASP
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_STAGE1_H
+#define WASP_STAGE1_H
+
+#include <stdint.h>
+
+#define CHUNK_SIZE	14
+
+#define START_ADDR			0xbd003000
+#define EXEC_ADDR			0xbd003000
+
+#define MDIO_ADDR			0x07
+#define MDIO_TIMEOUT_COUNT	1000
+
+#define RESP_RETRY			0x0102
+#define RESP_OK				0x0002
+#define RESP_WAIT			0x0401
+#define RESP_COMPLETED		0x0000
+#define RESP_READY_TO_START	0x0202
+#define RESP_STARTING       0x00c9
+
+#define CMD_SET_PARAMS				0x0c01
+#define CMD_SET_CHECKSUM_3390		0x0801
+#define CMD_SET_CHECKSUM_3490		0x0401
+#define CMD_SET_DATA				0x0e01
+#define CMD_START_FIRMWARE_3390		0x0201
+#define CMD_START_FIRMWARE_3490		0x0001
+#define CMD_START_FIRMWARE2_3490	0x0101
+
+/* Register layout: the status register is followed by seven data registers */
+#define REG_ZERO			0x0
+#define REG_STATUS_3390		0x700
+#define REG_STATUS_3490		0x0
+#define REG_DATA(status, n)	((status) + 2 * (n))
+
+typedef enum {
+	MODEL_3390,
+	MODEL_3490,
+	MODEL_UNKNOWN
+} t_model;
+
+#endif
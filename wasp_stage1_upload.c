@@ -0,0 +1,510 @@
+/*
+ * Stage 1 upload engine for AVM WASP as found in the FRITZ!Box 3390
+ *
+ * The protocol was found by dumping MDIO traffic between the two SoCs,
+ * so some things might be wrong or incomplete.
+ *
+ * MDIO read/write functions are taken from mdio-tool.c,
+ * Copyright (C) 2013 Pieter Voorthuijsen
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <time.h>
+
+#include "libwasp.h"
+#include "wasp_stage1.h"
+#include "wasp_mdio.h"
+#include "wasp_poll.h"
+#include "wasp_image.h"
+#include "wasp_plan.h"
+#include "wasp_report.h"
+#include "wasp_wait.h"
+#include "wasp_stage1_upload.h"
+
+/*
+ * Everything an upload to one WASP touches. In parallel mode every
+ * device is driven by its own thread and only shares the read-only plan.
+ */
+typedef struct {
+	char name[IFNAMSIZ];
+	int phy;
+	int prefix;			/* prefix messages with the name */
+	t_mdio *mdio;
+	t_poll poll;
+	t_wait wait;
+	t_report *report;
+	unsigned long handshake_polls;
+	const t_plan *plan;
+	pthread_t thread;
+	int ret;
+	uint64_t upload_ns;
+	uint64_t total_ns;
+} t_device;
+
+static const t_stage1_options *m_opts;
+static t_model m_model = MODEL_UNKNOWN;
+
+static t_device m_single;
+static t_report m_no_report;
+static t_report *m_report = &m_no_report;
+static int m_locked;
+
+static void dev_printf(const t_device *dev, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void dev_printf(const t_device *dev, const char *fmt, ...) {
+	va_list ap;
+
+	flockfile(stdout);
+	if(dev->prefix)
+		printf("%s: ", dev->name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	funlockfile(stdout);
+}
+
+/*
+ * Carry out the writes of an action. Command writes submit the queued
+ * data register writes together, data writes may be elided by the
+ * shadow register cache.
+ */
+static int do_writes(t_device *dev, const t_wasp1_action *act) {
+	int i;
+
+	for(i = 0; i < act->count; i++) {
+		const t_wasp1_write *w = &act->writes[i];
+
+		if(act->batch) {
+			if(mdio_batch_write(dev->mdio, w->location, w->value, w->flags & WASP1_WRITE_DATA) < 0)
+				return -1;
+		} else if(mdio_reg_write(dev->mdio, w->location, w->value) < 0) {
+			return -1;
+		}
+	}
+	if(act->batch && mdio_batch_submit(dev->mdio) < 0)
+		return -1;
+	if(act->invalidate)
+		mdio_shadow_invalidate(dev->mdio);
+	return 0;
+}
+
+static unsigned long count_polls(void) {
+	return m_single.poll.polls + m_single.handshake_polls;
+}
+
+static void print_stats(const t_device *dev, size_t size) {
+	const t_mdio *mdio = dev->mdio;
+	const t_poll *poll = &dev->poll;
+	double upload_s = dev->upload_ns / 1e9;
+
+	printf("Upload time    : %.3f ms (%.0f bytes/s)\n", dev->upload_ns / 1e6,
+		upload_s > 0 ? size / upload_s : 0.0);
+	printf("Total time     : %.3f ms\n", dev->total_ns / 1e6);
+	printf("MDIO accesses  : %lu reads, %lu writes, %lu writes saved by shadow cache\n",
+		mdio->reads, mdio->writes, mdio->writes_saved);
+	if(mdio->batches)
+		printf("MDIO batches   : %lu (%s)\n", mdio->batches, mdio_batch_path(mdio));
+	if(dev->wait.sleeps)
+		printf("Handshake      : %lu reads, %lu sleeps, %.1f us late on average, %.1f us at most%s\n",
+			dev->handshake_polls, dev->wait.sleeps,
+			dev->wait.late_sum_ns / 1e3 / dev->wait.sleeps, dev->wait.late_max_ns / 1e3,
+			dev->wait.realtime ? " (realtime)" : "");
+	printf("Polling        : %lu waits, %lu polls, %lu sleeps, %lu timeouts\n",
+		poll->waits, poll->polls, poll->sleeps, poll->timeouts);
+	if(poll->mode == POLL_MODE_ADAPTIVE)
+		printf("Turnaround     : %u us, %u.%02u polls per wait\n", poll->ewma_us16 >> 4,
+			poll->ewma_polls16 >> 4, (poll->ewma_polls16 & 0xf) * 100 / 16);
+}
+
+static t_poll_mode poll_mode = POLL_MODE_FIXED;
+
+/*
+ * Get the upload plan: replay a cached plan that matches the image and
+ * model, otherwise compile it from the image and refresh the cache.
+ */
+static int load_plan(t_plan *plan) {
+	t_image image;
+	int ret = 0;
+
+	if(!m_opts->filename) {
+		if(plan_load(plan, m_opts->plan) < 0) {
+			fprintf(stderr, "Invalid upload plan: %s\n", m_opts->plan);
+			return -1;
+		}
+		if(plan->model != m_model) {
+			fprintf(stderr, "Upload plan was compiled for a different model.\n");
+			plan_free(plan);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Snapshot the image, it must not change between checksum and upload */
+	if(image_load(&image, m_opts->filename, IMAGE_COPY) < 0) {
+		fprintf(stderr, "Input file not found.\n");
+		return -1;
+	}
+
+	if(image.size == 0) {
+		fprintf(stderr, "Error: Input file is empty\n");
+		ret = -1;
+		goto out;
+	}
+
+	if(image.size > 0xffff) {
+		fprintf(stderr, "Error: Input file too big\n");
+		ret = -1;
+		goto out;
+	}
+
+	if(m_opts->plan && !m_opts->compile_only && plan_load(plan, m_opts->plan) == 0) {
+		if(plan_matches(plan, m_model, image.data, image.size)) {
+			printf("Replaying cached upload plan.\n");
+			goto out;
+		}
+		plan_free(plan);
+	}
+
+	if(plan_compile(plan, m_model, image.data, image.size, START_ADDR, EXEC_ADDR) < 0) {
+		fprintf(stderr, "Error compiling upload plan\n");
+		ret = -1;
+		goto out;
+	}
+
+	if(m_opts->plan) {
+		if(plan_save(plan, m_opts->plan) < 0)
+			fprintf(stderr, "Warning: could not write upload plan %s\n", m_opts->plan);
+		else
+			printf("Wrote upload plan.\n");
+	}
+
+out:
+	image_free(&image);
+	return ret;
+}
+
+/* Parse "<iface>[:<phy>]" into the device name and PHY address */
+static int device_parse(t_device *dev, const char *spec) {
+	const char *colon = strrchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+	memset(dev, 0, sizeof(*dev));
+	dev->phy = MDIO_ADDR;
+	if(colon) {
+		char *end;
+
+		dev->phy = strtol(colon + 1, &end, 0);
+		if(*end || end == colon + 1 || dev->phy < 0 || dev->phy > 31) {
+			fprintf(stderr, "Invalid PHY address: %s\n", spec);
+			return -1;
+		}
+	}
+	if(len >= sizeof(dev->name)) {
+		fprintf(stderr, "Invalid interface name: %s\n", spec);
+		return -1;
+	}
+	memcpy(dev->name, spec, len);
+	return 0;
+}
+
+/* Validate the options and set up the register layout of the model */
+int stage1_init(const t_stage1_options *opts) {
+	int i;
+
+	m_opts = opts;
+	if(opts->report)
+		m_report = opts->report;
+
+	if(!m_opts->filename && !m_opts->plan) {
+		fprintf(stderr, "No input filename specified.\n");
+		return -1;
+	}
+
+	if(m_opts->compile_only && (!m_opts->filename || !m_opts->plan)) {
+		fprintf(stderr, "Compiling a plan needs both -f and -P.\n");
+		return -1;
+	}
+
+	if(!m_opts->iface && !m_opts->num_devices && !m_opts->compile_only && (!m_opts->transport || strcmp(m_opts->transport, "ioctl") == 0)) {
+		fprintf(stderr, "No interface specified.\n");
+		return -1;
+	}
+
+	if(!m_opts->model) {
+		fprintf(stderr, "No model specified.\n");
+		return -1;
+	}
+
+	if(strcmp(m_opts->model, "3390") == 0) {
+		m_model = MODEL_3390;
+	} else if(strcmp(m_opts->model, "3490") == 0) {
+		m_model = MODEL_3490;
+	} else {
+		fprintf(stderr, "Invalid model specified.\n");
+		return -1;
+	}
+
+	if(m_opts->num_devices > STAGE1_MAX_DEVICES) {
+		fprintf(stderr, "At most %d devices can be uploaded to at once.\n", STAGE1_MAX_DEVICES);
+		return -1;
+	}
+	for(i = 0; i < m_opts->num_devices; i++) {
+		if(device_parse(&m_single, m_opts->devices[i]) < 0)
+			return -1;
+	}
+
+	if(m_opts->poll && poll_parse_mode(m_opts->poll, &poll_mode) < 0) {
+		fprintf(stderr, "Invalid polling mode specified.\n");
+		return -1;
+	}
+
+	/*
+	 * Page faults during the handshake would defeat the realtime
+	 * priority. Lock now, before the combined uploader maps the stage 2
+	 * image on another thread, that must not be pinned.
+	 */
+	if(m_opts->realtime && !m_opts->compile_only) {
+		if(wait_lock_memory() == 0)
+			m_locked = 1;
+		else
+			fprintf(stderr, "Could not lock the memory, continuing without.\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Upload the plan and boot the firmware, returns an exit status. The
+ * protocol is driven by the libwasp state machine, this only does what
+ * it asks for: completion polls go through the configured polling
+ * strategy, everything else waits for the deadline of the action.
+ */
+static int upload(t_device *dev) {
+	const t_wasp1_action *act;
+	const char *phase = NULL;
+	t_wasp1 *sm;
+	uint64_t t_start;
+	int ret = 1;
+
+	sm = wasp1_new(dev->plan);
+	if(!sm) {
+		dev_printf(dev, "Could not set up the upload.\n");
+		return 1;
+	}
+
+	t_start = mdio_now_ns();
+	act = wasp1_step(sm, WASP1_EV_START, 0, t_start);
+	while(act->type == WASP1_ACT_READ || act->type == WASP1_ACT_WRITE) {
+		int regval = 0;
+
+		if(act->phase != phase) {
+			/* The upload time ends with the last chunk */
+			if(phase && strcmp(phase, "chunks") == 0) {
+				dev->upload_ns = mdio_now_ns() - t_start;
+				wait_begin(&dev->wait);
+			}
+			phase = act->phase;
+			report_begin(dev->report, phase);
+		}
+		if(act->msg)
+			dev_printf(dev, "%s\n", act->msg);
+
+		if(act->type == WASP1_ACT_READ && act->poll) {
+			if(poll_wait(&dev->poll, dev->mdio, act->location, act->expected, &regval) == POLL_ERROR)
+				act = wasp1_step(sm, WASP1_EV_ERROR, act->location, mdio_now_ns());
+			else
+				act = wasp1_step(sm, WASP1_EV_POLLED, regval, mdio_now_ns());
+		} else if(act->type == WASP1_ACT_READ) {
+			wait_until(&dev->wait, act->deadline);
+			if(mdio_reg_read(dev->mdio, act->location, &regval) < 0)
+				act = wasp1_step(sm, WASP1_EV_ERROR, act->location, mdio_now_ns());
+			else
+				act = wasp1_step(sm, WASP1_EV_READ, regval, mdio_now_ns());
+		} else {
+			wait_until(&dev->wait, act->deadline);
+			if(do_writes(dev, act) < 0)
+				act = wasp1_step(sm, WASP1_EV_ERROR, act->writes[0].location, mdio_now_ns());
+			else
+				act = wasp1_step(sm, WASP1_EV_WRITTEN, 0, mdio_now_ns());
+		}
+	}
+	wait_end(&dev->wait);
+	dev->handshake_polls = wasp1_handshake_polls(sm);
+
+	if(act->type == WASP1_ACT_DONE) {
+		report_end(dev->report);
+		dev->total_ns = mdio_now_ns() - t_start;
+		ret = 0;
+	}
+	if(act->msg)
+		dev_printf(dev, "%s\n", act->msg);
+	wasp1_free(sm);
+
+	return ret;
+}
+
+/* Set up a device and open its MDIO transport */
+static int device_open(t_device *dev, const char *spec) {
+	if(device_parse(dev, spec) < 0)
+		return -1;
+
+	dev->mdio = mdio_open(m_opts->transport, dev->name[0] ? dev->name : NULL, dev->phy, m_model);
+	if(!dev->mdio)
+		return -1;
+	dev->mdio->verbose = m_opts->verbose;
+	dev->mdio->shadow_enabled = !m_opts->no_shadow;
+	dev->mdio->batch_enabled = !m_opts->no_batch;
+	dev->report = &m_no_report;
+	poll_init(&dev->poll, poll_mode);
+	wait_init(&dev->wait, m_opts->realtime);
+	return 0;
+}
+
+static void *upload_thread(void *arg) {
+	t_device *dev = arg;
+
+	dev->ret = upload(dev);
+	return NULL;
+}
+
+/*
+ * Upload the plan to all devices at once, one thread per device. The
+ * WASPs spend most of the time answering commands, so the uploads
+ * overlap almost perfectly even on a single core.
+ */
+static int upload_parallel(const t_plan *plan) {
+	t_device *devs;
+	int num = m_opts->num_devices;
+	int failed = 0, ok = 0, started;
+	uint64_t t_start, total_ns;
+	unsigned long long bytes;
+	int i;
+
+	devs = calloc(num, sizeof(*devs));
+	if(!devs)
+		return 1;
+
+	for(i = 0; i < num; i++) {
+		if(device_open(&devs[i], m_opts->devices[i]) < 0) {
+			while(i--)
+				mdio_close(devs[i].mdio);
+			free(devs);
+			return 1;
+		}
+		devs[i].prefix = 1;
+		devs[i].plan = plan;
+		devs[i].ret = 1;
+	}
+	printf("MDIO transport : %s\n", devs[0].mdio->ops->name);
+	printf("Polling mode   : %s\n", poll_mode_name(devs[0].poll.mode));
+	printf("Batched writes : %s\n", mdio_batch_path(devs[0].mdio));
+	printf("Devices        : %d\n", num);
+
+	report_begin(m_report, "parallel");
+	t_start = mdio_now_ns();
+	for(i = 0; i < num; i++) {
+		if(pthread_create(&devs[i].thread, NULL, upload_thread, &devs[i]) != 0) {
+			fprintf(stderr, "Could not start a thread for %s.\n", devs[i].name);
+			break;
+		}
+	}
+	/* The devices left without a thread are not touched and count as failed */
+	started = i;
+	for(i = 0; i < started; i++)
+		pthread_join(devs[i].thread, NULL);
+	total_ns = mdio_now_ns() - t_start;
+	report_end(m_report);
+
+	for(i = 0; i < num; i++) {
+		t_device *dev = &devs[i];
+
+		if(dev->ret) {
+			printf("%-15s: failed\n", dev->name);
+			failed++;
+		} else {
+			printf("%-15s: upload %.3f ms, total %.3f ms, %lu reads, %lu writes, %lu polls\n",
+				dev->name, dev->upload_ns / 1e6, dev->total_ns / 1e6,
+				dev->mdio->reads, dev->mdio->writes,
+				dev->poll.polls + dev->handshake_polls);
+			ok++;
+		}
+		mdio_close(dev->mdio);
+	}
+	bytes = (unsigned long long)plan->size * ok;
+	printf("Uploaded to %d of %d WASPs in %.3f ms (%.0f bytes/s)\n", ok, num,
+		total_ns / 1e6, total_ns ? bytes / (total_ns / 1e9) : 0.0);
+
+	free(devs);
+	return failed ? 1 : 0;
+}
+
+/*
+ * Compile or replay the upload plan and upload it, returns an exit
+ * status.
+ */
+int stage1_upload(void) {
+	t_device *dev = &m_single;
+	t_plan plan;
+	int ret;
+
+	if(load_plan(&plan) < 0) {
+		ret = 1;
+		goto out_unlock;
+	}
+
+	printf("Checksum       : 0x%8x\n", plan.checksum);
+	if(m_opts->compile_only) {
+		plan_free(&plan);
+		return 0;
+	}
+
+	if(m_opts->num_devices > 1) {
+		ret = upload_parallel(&plan);
+		goto out;
+	}
+
+	if(device_open(dev, m_opts->num_devices ? m_opts->devices[0] :
+			m_opts->iface ? m_opts->iface : "") < 0) {
+		ret = -1;
+		goto out;
+	}
+	dev->mdio->capture = m_opts->capture;
+	dev->report = m_report;
+	dev->plan = &plan;
+	printf("MDIO transport : %s\n", dev->mdio->ops->name);
+	printf("Polling mode   : %s\n", poll_mode_name(dev->poll.mode));
+	printf("Batched writes : %s\n", mdio_batch_path(dev->mdio));
+
+	m_report->polls = count_polls;
+	ret = upload(dev);
+	if(ret == 0)
+		print_stats(dev, plan.size);
+
+	mdio_close(dev->mdio);
+	dev->mdio = NULL;
+
+out:
+	plan_free(&plan);
+out_unlock:
+	/* Stage 2 must not run with the stage 1 memory pinned */
+	if(m_locked) {
+		wait_unlock_memory();
+		m_locked = 0;
+	}
+	return ret;
+}
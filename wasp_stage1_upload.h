@@ -0,0 +1,47 @@
+/*
+ * Stage 1 upload engine for AVM WASP
+ *
+ * stage1_init() validates the options, which must stay valid until the
+ * upload is done. stage1_upload() then compiles or replays the upload
+ * plan, pushes it over MDIO and walks the WASP through the boot
+ * handshake until the stage 1 firmware runs.
+ *
+ * Devices are given as "<iface>[:<phy>]", the PHY address defaults to
+ * MDIO_ADDR. With more than one device the plan is uploaded to all of
+ * them at once, each device on its own thread with its own MDIO
+ * transport, poll state and statistics.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_STAGE1_UPLOAD_H
+#define WASP_STAGE1_UPLOAD_H
+
+#include "wasp_capture.h"
+#include "wasp_report.h"
+
+typedef struct {
+	const char *filename;	/* firmware, NULL to replay the plan as is */
+	const char *plan;		/* optional plan cache */
+	int compile_only;
+	const char *iface;		/* single device */
+	const char *const *devices;	/* optional, overrides iface */
+	int num_devices;
+	const char *model;		/* "3390" or "3490" */
+	const char *transport;	/* NULL for ioctl */
+	const char *poll;		/* NULL for fixed */
+	int verbose;
+	int no_shadow;
+	int no_batch;
+	int realtime;		/* boot handshake with SCHED_FIFO and locked memory */
+	t_report *report;		/* optional */
+	t_capture *capture;		/* optional */
+} t_stage1_options;
+
+#define STAGE1_MAX_DEVICES	64
+
+int stage1_init(const t_stage1_options *opts);
+int stage1_upload(void);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Stage 2 (Ethernet) protocol definitions for AVM WASP
+ *
+ * All header fields and the load address are big endian on the wire,
+ * as sent by the big endian MIPS host SoC.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_STAGE2_H
+#define WASP_STAGE2_H
+
+#include <stdint.h>
+
+#define ETHER_TYPE 			0x88bd
+#define COUNTER_INCR		4
+
+#define MAX_PAYLOAD_SIZE	1028
+#define CHUNK_SIZE			1024
+#define WASP_HEADER_LEN		14
+
+#define LOAD_ADDR			0x81a00000
+
+#define PACKET_START		0x1200
+#define CMD_FIRMWARE_DATA	0x0104
+#define CMD_START_FIRMWARE	0xd400
+
+#define RESP_DISCOVER		0x0000
+#define RESP_CONFIG			0x1000
+#define RESP_OK				0x0100
+#define RESP_STARTING		0x0200
+#define RESP_ERROR			0x0300
+
+typedef struct __attribute__((packed)) {
+	union {
+		uint8_t data[MAX_PAYLOAD_SIZE + WASP_HEADER_LEN];
+		struct __attribute__((packed)) {
+			uint16_t	packet_start;
+			uint8_t		pad_one[5];
+			uint16_t	command;
+			uint16_t	response;
+			uint16_t	counter;
+			uint8_t		pad_two;
+			uint8_t		payload[MAX_PAYLOAD_SIZE];
+		};
+	};
+} t_wasp_packet;
+
+#endif
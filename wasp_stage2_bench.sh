@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Stage 2 benchmark: uploads an 8 MB firmware and a config to the WASP
+# emulator over a veth pair. With PEERS set, that many emulators share a
+# bridge and the uploader serves all of them in server mode. Needs root.
+#
+# Environment:
+#   EMU_ARGS       extra emulator options, e.g. "-d 200 -l 1 -r 1"
+#   UPLOADER_ARGS  extra uploader options, e.g. "-R"
+#   FW_SIZE_KB     firmware size in KiB (default: 8192)
+#   PEERS          number of emulated WASPs (default: 1)
+#
+# (c) 2019-2020 Andreas Böhler
+# GPLv2
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+HOST_IF=wasp-bench0
+WASP_IF=wasp-bench1
+BRIDGE=wasp-bench
+PEERS=${PEERS:-1}
+TMP=$(mktemp -d)
+
+cleanup() {
+	ip link del "$HOST_IF" 2>/dev/null || true
+	for i in $(seq 1 "$PEERS"); do
+		ip link del "wasp-bench-w$i" 2>/dev/null || true
+	done
+	ip link del "$BRIDGE" 2>/dev/null || true
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+dd if=/dev/urandom of="$TMP/fw.bin" bs=1024 count="${FW_SIZE_KB:-8192}" 2>/dev/null
+dd if=/dev/urandom of="$TMP/config.tgz" bs=1000 count=5 2>/dev/null
+
+if [ "$PEERS" -le 1 ]; then
+	ip link add "$HOST_IF" type veth peer name "$WASP_IF"
+	ip link set "$HOST_IF" up
+	ip link set "$WASP_IF" up
+
+	"$DIR/wasp_stage2_emu" -i "$WASP_IF" -f "$TMP/fw.bin" -c "$TMP/config.tgz" $EMU_ARGS &
+	EMU=$!
+	sleep 0.2
+
+	"$DIR/wasp_uploader_stage2" -i "$HOST_IF" -f "$TMP/fw.bin" -c "$TMP/config.tgz" $UPLOADER_ARGS >/dev/null
+	wait $EMU
+	exit 0
+fi
+
+ip link add "$BRIDGE" type bridge
+ip link set "$BRIDGE" up
+ip link add "$HOST_IF" type veth peer name "$WASP_IF"
+ip link set "$WASP_IF" master "$BRIDGE"
+ip link set "$HOST_IF" up
+ip link set "$WASP_IF" up
+for i in $(seq 1 "$PEERS"); do
+	ip link add "wasp-bench-w$i" type veth peer name "wasp-bench-b$i"
+	ip link set "wasp-bench-b$i" master "$BRIDGE"
+	ip link set "wasp-bench-w$i" up
+	ip link set "wasp-bench-b$i" up
+done
+sleep 1
+
+EMUS=
+for i in $(seq 1 "$PEERS"); do
+	"$DIR/wasp_stage2_emu" -i "wasp-bench-w$i" -f "$TMP/fw.bin" -c "$TMP/config.tgz" -s "$i" $EMU_ARGS >"$TMP/emu$i.log" &
+	EMUS="$EMUS $!"
+done
+sleep 0.2
+
+"$DIR/wasp_uploader_stage2" -i "$HOST_IF" -f "$TMP/fw.bin" -c "$TMP/config.tgz" -S -N "$PEERS" $UPLOADER_ARGS >"$TMP/server.log"
+tail -n 2 "$TMP/server.log"
+for pid in $EMUS; do
+	wait "$pid"
+done
@@ -0,0 +1,589 @@
+/*
+ * Emulated AVM WASP stage 2 bootloader
+ *
+ * Speaks the stage 2 Ethernet protocol on one end of a veth pair (or any
+ * other interface): announces itself with discovery packets, reassembles
+ * the firmware, checks the load address in front of the first and
+ * behind the last chunk, then asks for the config. Every received image
+ * can be compared against a reference file.
+ *
+ * ACKs can be delayed, frames dropped and ACKs reordered or duplicated to
+ * exercise the uploader's retransmission logic. A busy WASP that drops every frame
+ * arriving before its previous reply went out can be emulated to test
+ * the uploader's window probing. At the end the achieved frame rate,
+ * throughput and total time are reported, which makes this a repeatable
+ * stage 2 benchmark without hardware.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/ether.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "wasp_image.h"
+#include "wasp_stage2.h"
+
+/* Room for jumbo frames, larger payloads than -m are answered with an error */
+#define MAX_RX_PAYLOAD			9000
+#define FRAME_SIZE				(sizeof(struct ether_header) + WASP_HEADER_LEN + MAX_RX_PAYLOAD)
+#define DISCOVER_INTERVAL_US	200000
+#define REORDER_DELAY_US		2000
+#define MAX_PENDING				64
+#define TOTAL_TIMEOUT_S			60
+
+typedef enum {
+	EMU_STATE_DISCOVER,
+	EMU_STATE_FIRMWARE,
+	EMU_STATE_WAIT_CONFIG,
+	EMU_STATE_CONFIG,
+	EMU_STATE_DONE,
+	EMU_STATE_FAILED
+} t_emu_state;
+
+/* A reply waiting for its due time */
+typedef struct {
+	uint64_t due;
+	uint16_t response;
+	uint16_t counter;
+} t_pending;
+
+/* One received image */
+typedef struct {
+	const char *name;
+	uint8_t *data;
+	size_t size;
+	size_t alloc;
+	unsigned int frames;
+	uint64_t start_us;
+	uint64_t end_us;
+} t_rx_image;
+
+static t_emu_state m_state = EMU_STATE_DISCOVER;
+static uint8_t m_peer_mac[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+static uint8_t m_own_mac[ETH_ALEN];
+static uint16_t m_expected;
+static t_pending m_pending[MAX_PENDING];
+static int m_num_pending;
+static t_rx_image m_firmware = { .name = "firmware" };
+static t_rx_image m_config = { .name = "config" };
+
+static unsigned long m_frames;
+static unsigned long m_dropped;
+static unsigned long m_duplicates;
+static unsigned long m_out_of_order;
+static unsigned long m_reordered;
+static unsigned long m_replies_duplicated;
+static unsigned long m_busy;
+static unsigned long m_oversized;
+
+static char *opt_iface;
+static char *opt_firmware;
+static char *opt_config;
+static char *progname;
+static int opt_verbose = 0;
+static int opt_busy = 0;
+static int opt_latency_us = 0;
+static double opt_loss = 0;
+static double opt_reorder = 0;
+static double opt_duplicate = 0;
+static unsigned int opt_seed = 1;
+static int opt_total_timeout = TOTAL_TIMEOUT_S;
+static size_t opt_max_payload = MAX_PAYLOAD_SIZE;
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int chance(double percent) {
+	return percent > 0 && rand() < percent / 100.0 * RAND_MAX;
+}
+
+/* Replies are padded to the minimum Ethernet frame size, as on the wire */
+static int send_reply(int sockfd, uint16_t response, uint16_t counter) {
+	uint8_t frame[ETH_ZLEN];
+	struct ether_header *eh = (struct ether_header *)frame;
+	t_wasp_packet *packet = (t_wasp_packet *)(frame + sizeof(struct ether_header));
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(eh->ether_dhost, m_peer_mac, ETH_ALEN);
+	memcpy(eh->ether_shost, m_own_mac, ETH_ALEN);
+	eh->ether_type = htons(ETHER_TYPE);
+	packet->packet_start = htons(PACKET_START);
+	packet->response = htons(response);
+	packet->counter = htons(counter);
+
+	if(send(sockfd, frame, sizeof(frame), 0) < 0) {
+		perror("send");
+		return -1;
+	}
+	return 0;
+}
+
+/* Queue a reply, it goes out after the configured latency */
+static void queue_reply_at(uint16_t response, uint16_t counter, uint64_t due) {
+	t_pending *p;
+
+	if(m_num_pending == MAX_PENDING) {
+		m_dropped++;
+		return;
+	}
+	p = &m_pending[m_num_pending++];
+	p->due = due;
+	p->response = response;
+	p->counter = counter;
+}
+
+static void queue_reply(uint16_t response, uint16_t counter) {
+	uint64_t due = now_us() + opt_latency_us;
+
+	if(chance(opt_reorder)) {
+		due += REORDER_DELAY_US;
+		m_reordered++;
+	}
+	queue_reply_at(response, counter, due);
+	/* Like a flooding switch, the copy arrives later */
+	if(chance(opt_duplicate)) {
+		queue_reply_at(response, counter, due + REORDER_DELAY_US);
+		m_replies_duplicated++;
+	}
+}
+
+/* Send all replies that are due, in the order of their due time */
+static int flush_replies(int sockfd, uint64_t *next_due) {
+	uint64_t now = now_us();
+
+	*next_due = 0;
+	while(m_num_pending) {
+		int i, first = 0;
+
+		for(i = 1; i < m_num_pending; i++) {
+			if(m_pending[i].due < m_pending[first].due)
+				first = i;
+		}
+		if(m_pending[first].due > now) {
+			*next_due = m_pending[first].due;
+			break;
+		}
+		if(send_reply(sockfd, m_pending[first].response, m_pending[first].counter) < 0)
+			return -1;
+		m_pending[first] = m_pending[--m_num_pending];
+	}
+	return 0;
+}
+
+static int rx_append(t_rx_image *img, const uint8_t *data, size_t len) {
+	if(img->size + len > img->alloc) {
+		size_t alloc = img->alloc ? img->alloc * 2 : 1024 * 1024;
+		uint8_t *buf;
+
+		while(alloc < img->size + len)
+			alloc *= 2;
+		buf = realloc(img->data, alloc);
+		if(!buf) {
+			fprintf(stderr, "Out of memory.\n");
+			return -1;
+		}
+		img->data = buf;
+		img->alloc = alloc;
+	}
+	memcpy(img->data + img->size, data, len);
+	img->size += len;
+	return 0;
+}
+
+/* Compare a received image against its reference file, if one was given */
+static int rx_verify(const t_rx_image *img, const char *filename) {
+	t_image ref;
+	int ret = 0;
+
+	if(!filename)
+		return 0;
+	if(image_load(&ref, filename, IMAGE_MAP) < 0) {
+		fprintf(stderr, "Could not read reference %s: %s\n", img->name, filename);
+		return -1;
+	}
+	if(ref.size != img->size || memcmp(ref.data, img->data, ref.size) != 0) {
+		fprintf(stderr, "%s mismatch: received %zu bytes, expected %zu bytes\n",
+			img->name, img->size, ref.size);
+		ret = -1;
+	}
+	image_free(&ref);
+	return ret;
+}
+
+static void rx_report(const t_rx_image *img) {
+	double secs = (img->end_us - img->start_us) / 1e6;
+
+	if(!img->frames)
+		return;
+	if(secs <= 0)
+		secs = 1e-6;
+	printf("%-8s: %zu bytes in %u frames, %.3f s, %.0f frames/s, %.2f MB/s\n",
+		img->name, img->size, img->frames, secs, img->frames / secs,
+		img->size / secs / 1e6);
+}
+
+/*
+ * Handle one data frame of the firmware or config download. Frames are
+ * accepted strictly in counter order; an old counter is a retransmission
+ * whose ACK got lost and is acknowledged again.
+ */
+static int handle_data(const t_wasp_packet *packet, size_t len) {
+	int firmware = (m_state == EMU_STATE_FIRMWARE);
+	t_rx_image *img = firmware ? &m_firmware : &m_config;
+	uint16_t counter = ntohs(packet->counter);
+	int last = (ntohs(packet->response) == CMD_START_FIRMWARE);
+	const uint8_t *payload = packet->payload;
+	uint32_t addr;
+
+	/* The frame did not fit into the buffer, it is rejected but no harm done */
+	if(len > opt_max_payload) {
+		m_oversized++;
+		queue_reply(RESP_ERROR, counter);
+		return 0;
+	}
+
+	if(counter != m_expected) {
+		if((uint16_t)(m_expected - counter) < 0x8000) {
+			m_duplicates++;
+			queue_reply(RESP_OK, counter);
+		} else {
+			m_out_of_order++;
+		}
+		return 0;
+	}
+
+	if(firmware && img->frames == 0) {
+		if(len < sizeof(addr))
+			return -1;
+		memcpy(&addr, payload, sizeof(addr));
+		if(ntohl(addr) != LOAD_ADDR) {
+			fprintf(stderr, "Bad load address in front of the firmware: 0x%08x\n", ntohl(addr));
+			return -1;
+		}
+		payload += sizeof(addr);
+		len -= sizeof(addr);
+	}
+	if(firmware && last) {
+		if(len < sizeof(addr))
+			return -1;
+		len -= sizeof(addr);
+		memcpy(&addr, payload + len, sizeof(addr));
+		if(ntohl(addr) != LOAD_ADDR) {
+			fprintf(stderr, "Bad load address marker behind the firmware: 0x%08x\n", ntohl(addr));
+			return -1;
+		}
+	}
+
+	if(rx_append(img, payload, len) < 0)
+		return -1;
+	img->frames++;
+	img->end_us = now_us();
+	m_expected += COUNTER_INCR;
+
+	if(!last) {
+		queue_reply(RESP_OK, counter);
+		return 0;
+	}
+
+	if(rx_verify(img, firmware ? opt_firmware : opt_config) < 0)
+		return -1;
+	if(opt_verbose)
+		printf("Received %s, %zu bytes.\n", img->name, img->size);
+	queue_reply(RESP_STARTING, counter);
+	m_expected = 0;
+	if(firmware && opt_config)
+		m_state = EMU_STATE_WAIT_CONFIG;
+	else
+		m_state = EMU_STATE_DONE;
+	return 0;
+}
+
+static void usage(int status)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS...]\n", progname);
+	fprintf(stderr,
+"\n"
+"Options:\n"
+"  -i <interface>  emulate the WASP on the specified interface\n"
+"  -f <file>       compare the received firmware against this file\n"
+"  -c <file>       request a config after the firmware and compare it\n"
+"                  against this file\n"
+"  -d <us>         delay every reply by this many microseconds\n"
+"  -l <percent>    drop this share of the received frames\n"
+"  -r <percent>    delay this share of the replies by another %d us,\n"
+"                  so later replies overtake them\n"
+"  -D <percent>    send this share of the replies twice, the copy %d us\n"
+"                  later\n"
+"  -b              drop frames that arrive while a reply is pending\n"
+"  -m <bytes>      answer frames with a larger payload with an error\n"
+"                  (default: %d, at most %d)\n"
+"  -s <seed>       seed for loss, reordering and duplicates (default: 1)\n"
+"  -T <seconds>    give up after this time (default: 60)\n"
+"  -v              verbose output\n"
+"  -h              show this screen\n"
+	, REORDER_DELAY_US, REORDER_DELAY_US, MAX_PAYLOAD_SIZE, MAX_RX_PAYLOAD);
+
+	exit(status);
+}
+
+int main(int argc, char *argv[]) {
+	uint8_t buf[FRAME_SIZE];
+	struct ether_header *eh = (struct ether_header *)buf;
+	t_wasp_packet *packet = (t_wasp_packet *)(buf + sizeof(struct ether_header));
+	struct sockaddr_ll addr;
+	struct ifreq if_mac;
+	struct pollfd pfd;
+	uint64_t next_discover = 0;
+	uint64_t deadline;
+	int sockfd;
+	int ret = EXIT_FAILURE;
+
+	progname = basename(argv[0]);
+
+	while(1) {
+		int c;
+
+		c = getopt(argc, argv, "i:f:c:d:l:r:D:bm:s:T:hv");
+		if(c == -1)
+			break;
+
+		switch(c) {
+		case 'i':
+			opt_iface = optarg;
+			break;
+
+		case 'f':
+			opt_firmware = optarg;
+			break;
+
+		case 'c':
+			opt_config = optarg;
+			break;
+
+		case 'd':
+			opt_latency_us = atoi(optarg);
+			break;
+
+		case 'l':
+			opt_loss = atof(optarg);
+			break;
+
+		case 'r':
+			opt_reorder = atof(optarg);
+			break;
+
+		case 'D':
+			opt_duplicate = atof(optarg);
+			break;
+
+		case 'b':
+			opt_busy = 1;
+			break;
+
+		case 'm':
+			opt_max_payload = strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			opt_seed = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'T':
+			opt_total_timeout = atoi(optarg);
+			break;
+
+		case 'v':
+			opt_verbose = 1;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if(!opt_iface) {
+		fprintf(stderr, "No interface specified.\n");
+		return EXIT_FAILURE;
+	}
+	srand(opt_seed);
+
+	if((sockfd = socket(PF_PACKET, SOCK_RAW, htons(ETHER_TYPE))) == -1) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETHER_TYPE);
+	addr.sll_ifindex = if_nametoindex(opt_iface);
+	if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		close(sockfd);
+		return EXIT_FAILURE;
+	}
+
+	memset(&if_mac, 0, sizeof(if_mac));
+	strncpy(if_mac.ifr_name, opt_iface, IFNAMSIZ-1);
+	if(ioctl(sockfd, SIOCGIFHWADDR, &if_mac) < 0) {
+		perror("SIOCGIFHWADDR");
+		close(sockfd);
+		return EXIT_FAILURE;
+	}
+	memcpy(m_own_mac, if_mac.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	printf("AVM WASP stage 2 emulator on %s.\n", opt_iface);
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	deadline = now_us() + opt_total_timeout * 1000000ull;
+
+	while(m_state != EMU_STATE_DONE && m_state != EMU_STATE_FAILED) {
+		uint64_t now = now_us();
+		uint64_t next_due;
+		uint64_t wake = deadline;
+		struct timespec timeout;
+		socklen_t addrlen = sizeof(addr);
+		ssize_t numbytes;
+		int i;
+
+		if(now >= deadline) {
+			fprintf(stderr, "Timed out waiting for the uploader.\n");
+			break;
+		}
+
+		if(flush_replies(sockfd, &next_due) < 0)
+			break;
+		if(next_due && next_due < wake)
+			wake = next_due;
+
+		/*
+		 * Announce ourselves until the uploader starts sending. The config
+		 * request waits until the firmware's last reply went out.
+		 */
+		if((m_state == EMU_STATE_DISCOVER || m_state == EMU_STATE_WAIT_CONFIG) && !m_num_pending) {
+			if(now >= next_discover) {
+				send_reply(sockfd, m_state == EMU_STATE_DISCOVER ? RESP_DISCOVER : RESP_CONFIG, 0);
+				next_discover = now + DISCOVER_INTERVAL_US;
+			}
+			if(next_discover < wake)
+				wake = next_discover;
+		}
+
+		/* Microsecond resolution, poll() would round the ACK latency up to 1 ms */
+		now = now_us();
+		timeout.tv_sec = wake > now ? (wake - now) / 1000000 : 0;
+		timeout.tv_nsec = wake > now ? (wake - now) % 1000000 * 1000 : 0;
+		i = ppoll(&pfd, 1, &timeout, NULL);
+		if(i < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("ppoll");
+			break;
+		}
+		if(i == 0)
+			continue;
+
+		numbytes = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addrlen);
+		if(numbytes < 0) {
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("recvfrom");
+			break;
+		}
+		/* Like the WASP, only take frames addressed to us */
+		if(addr.sll_pkttype == PACKET_OUTGOING || addr.sll_pkttype == PACKET_OTHERHOST)
+			continue;
+		if(numbytes < (ssize_t)(sizeof(struct ether_header) + WASP_HEADER_LEN) ||
+		   packet->packet_start != htons(PACKET_START))
+			continue;
+		if(packet->command != htons(CMD_FIRMWARE_DATA) &&
+		   packet->response != htons(CMD_START_FIRMWARE))
+			continue;
+
+		m_frames++;
+		if(chance(opt_loss)) {
+			m_dropped++;
+			continue;
+		}
+		if(opt_busy && m_num_pending) {
+			m_busy++;
+			continue;
+		}
+
+		/* The first data frame ends the discovery */
+		if(m_state == EMU_STATE_DISCOVER || m_state == EMU_STATE_WAIT_CONFIG) {
+			if(packet->counter != 0)
+				continue;
+			memcpy(m_peer_mac, eh->ether_shost, ETH_ALEN);
+			if(m_state == EMU_STATE_DISCOVER) {
+				m_state = EMU_STATE_FIRMWARE;
+				m_firmware.start_us = now_us();
+			} else {
+				m_state = EMU_STATE_CONFIG;
+				m_config.start_us = now_us();
+			}
+		}
+
+		if(handle_data(packet, numbytes - sizeof(struct ether_header) - WASP_HEADER_LEN) < 0) {
+			queue_reply(RESP_ERROR, ntohs(packet->counter));
+			m_state = EMU_STATE_FAILED;
+		}
+	}
+
+	/* Get the last replies out */
+	while(m_num_pending) {
+		uint64_t next_due, now;
+
+		if(flush_replies(sockfd, &next_due) < 0)
+			break;
+		now = now_us();
+		if(next_due > now)
+			usleep(next_due - now);
+	}
+	close(sockfd);
+
+	rx_report(&m_firmware);
+	rx_report(&m_config);
+	if(m_firmware.frames) {
+		uint64_t end = m_config.frames ? m_config.end_us : m_firmware.end_us;
+
+		printf("total   : %.3f s, %lu frames received, %lu dropped, %lu duplicates, "
+			"%lu out of order, %lu replies reordered, %lu duplicated, %lu dropped while busy, "
+			"%lu too large\n",
+			(end - m_firmware.start_us) / 1e6, m_frames, m_dropped,
+			m_duplicates, m_out_of_order, m_reordered, m_replies_duplicated, m_busy, m_oversized);
+	}
+
+	if(m_state == EMU_STATE_DONE) {
+		printf("Upload verified.\n");
+		ret = EXIT_SUCCESS;
+	}
+
+	free(m_firmware.data);
+	free(m_config.data);
+	return ret;
+}
@@ -0,0 +1,1007 @@
+/*
+ * Stage 2 upload engine for AVM WASP as found in the FRITZ!Box 3390
+ *
+ * The protocol was found by sniffing ethernet traffic between the two SoCs,
+ * so some things might be wrong or incomplete.
+ *
+ * Important: if the switch is configured for VLAN tagging, the eth0.1 interface
+ *            has to be used, not eth0!
+ *
+ * (c) 2019 Andreas Böhler
+ * GPLv2
+ */
+
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netinet/ether.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "libwasp.h"
+#include "wasp_capture.h"
+#include "wasp_config.h"
+#include "wasp_file.h"
+#include "wasp_image.h"
+#include "wasp_report.h"
+#include "wasp_stage2.h"
+#include "wasp_stage2_upload.h"
+#include "wasp_stream.h"
+#include "wasp_txring.h"
+
+#define BUF_SIZE			1056
+
+#define ACK_TIMEOUT_MS		100
+#define ACK_RETRIES			5
+#define TOTAL_TIMEOUT_S		60
+#define CHUNK_CACHE_DEFAULT	"default"
+/* A compressed firmware is decompressed this far ahead of the ACKs */
+#define STREAM_WINDOW		(1024 * 1024)
+
+typedef enum {
+	PEER_BUSY = 0,
+	PEER_DONE,
+	PEER_FAILED
+} t_peer_status;
+
+/* One WASP: its protocol state machine and how frames reach it */
+typedef struct {
+	uint8_t mac[ETH_ALEN];
+	struct ether_header eth_header;
+	t_wasp2 *sm;
+	uint64_t deadline;		/* ms, when the state machine wants its timer */
+	int sent;			/* chunks of the current image sent at least once */
+	int ring;			/* chunks go out through m_tx_ring */
+	t_peer_status status;
+	uint64_t start_ns;		/* discovery, for the per-peer statistics */
+} t_peer;
+
+/* Both images are loaded once, frames point straight into them */
+static t_image m_firmware;
+static t_image m_config;
+/* Fills m_firmware if that is compressed */
+static t_stream m_stream;
+
+/* The WASP of a single upload, see stage2_run() */
+static t_peer m_peer;
+static int m_filter_narrowed = 0;
+
+static t_report m_no_report;
+static t_report *m_report = &m_no_report;
+static t_capture *m_capture;
+static const char *m_phase;
+
+/* Optional TX ring, chunk i of the transfer goes into slot base + i */
+static t_txring m_tx_ring = { .fd = -1 };
+static unsigned int m_ring_base;
+static int m_ring_fill;
+
+static t_stage2_options m_opts;
+/* Chunk size negotiation, see stage2_prepare() */
+static int m_max_chunk;
+static int m_chunk_hint;
+
+/* Set up by stage2_prepare() */
+static int m_sockfd = -1;
+static int m_ifindex;
+static long long m_rx_start;
+static uint8_t m_own_mac[ETH_ALEN];
+static volatile sig_atomic_t m_stop;
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void) {
+	return now_ns() / 1000000;
+}
+
+/* Start a report phase, repeated discovery packets stay in the same one */
+static void set_phase(const char *name) {
+	if(m_opts.server || m_phase == name)
+		return;
+	m_phase = name;
+	report_begin(m_report, name);
+}
+
+/* Progress messages name the WASP when serving several */
+static void peer_log(const t_peer *peer, const char *msg) {
+	if(m_opts.server)
+		printf("%s: %s\n", ether_ntoa((const struct ether_addr *)peer->mac), msg);
+	else
+		printf("%s\n", msg);
+}
+
+static int peer_init(t_peer *peer, const uint8_t *mac) {
+	t_wasp2_params params = {
+		.ack_timeout = m_opts.ack_timeout,
+		.retries = m_opts.retries,
+		.window = m_opts.window,
+		.strict = m_opts.strict,
+		.max_chunk = m_max_chunk,
+		.chunk_hint = m_chunk_hint,
+	};
+
+	memset(peer, 0, sizeof(*peer));
+	memcpy(peer->mac, mac, ETH_ALEN);
+	memcpy(peer->eth_header.ether_dhost, mac, ETH_ALEN);
+	memcpy(peer->eth_header.ether_shost, m_own_mac, ETH_ALEN);
+	peer->eth_header.ether_type = htons(ETHER_TYPE);
+	peer->ring = (m_tx_ring.map != NULL && !m_opts.server);
+	peer->sm = wasp2_new(m_firmware.data, m_firmware.size,
+		m_opts.config ? m_config.data : NULL, m_config.size, &params);
+	if(!peer->sm) {
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void peer_free(t_peer *peer) {
+	wasp2_free(peer->sm);
+	peer->sm = NULL;
+}
+
+/*
+ * Describe chunk index of the peer's current image as an I/O vector:
+ * the prebuilt Ethernet header, then the WASP header in hdr and the
+ * slice of the image from wasp2_chunk(). Returns the number of entries
+ * used in iov.
+ */
+static int chunk_iov(const t_peer *peer, int index, uint8_t *hdr, struct iovec *iov) {
+	iov[0].iov_base = (void *)&peer->eth_header;
+	iov[0].iov_len = sizeof(peer->eth_header);
+	return 1 + wasp2_chunk(peer->sm, index, hdr, iov + 1);
+}
+
+static void print_chunk(const t_peer *peer, int index) {
+	uint8_t hdr[WASP2_HEADER_LEN];
+	struct iovec iov[1 + WASP2_CHUNK_IOV];
+	size_t tx_len = 0;
+	int i, n;
+
+	n = chunk_iov(peer, index, hdr, iov);
+	for(i = 0; i < n; i++)
+		tx_len += iov[i].iov_len;
+	printf("Send (%zu bytes): ", tx_len);
+	for(i = 0; i < n; i++) {
+		for(size_t j = 0; j < iov[i].iov_len; j++)
+			printf("0x%x ", ((uint8_t *)iov[i].iov_base)[j]);
+	}
+	printf("\n");
+}
+
+/* Whether the image data of a chunk is decompressed, waiting for it if asked to */
+static int chunk_ready(const struct iovec *iov, int n, int wait) {
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(!wait && !stream_ready(&m_stream, iov[i].iov_base, iov[i].iov_len))
+			return 0;
+		if(wait && stream_wait(&m_stream, iov[i].iov_base, iov[i].iov_len) < 0) {
+			fprintf(stderr, "Decompressing the firmware failed.\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Gather chunk index straight from the image with sendmsg(). Returns -1
+ * if the chunk can never be sent.
+ */
+static int send_chunk(const t_peer *peer, int index) {
+	uint8_t hdr[WASP2_HEADER_LEN];
+	struct iovec iov[1 + WASP2_CHUNK_IOV];
+	struct msghdr msg;
+
+	/* The socket is bound to the interface, no address needed */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = chunk_iov(peer, index, hdr, iov);
+	if(!chunk_ready(iov, msg.msg_iovlen, 1))
+		return -1;
+	if(m_opts.verbose)
+		print_chunk(peer, index);
+	capture_packet(m_capture, iov, msg.msg_iovlen, CAPTURE_OUT);
+	report_syscall(REPORT_SYS_SEND);
+	if (sendmsg(m_sockfd, &msg, 0) < 0) {
+		fprintf(stderr, "Send failed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Build the frames of the upcoming chunks in the free ring slots. This
+ * runs right after a frame went out, while we wait for the WASP anyway.
+ */
+static void ring_prefill(const t_peer *peer) {
+	uint8_t hdr[WASP2_HEADER_LEN];
+	struct iovec iov[1 + WASP2_CHUNK_IOV];
+	int num_chunks = wasp2_num_chunks(peer->sm);
+
+	while(m_ring_fill < num_chunks &&
+	      m_ring_fill < peer->sent + (int)m_tx_ring.frames) {
+		unsigned int slot = (m_ring_base + m_ring_fill) % m_tx_ring.frames;
+		int n = chunk_iov(peer, m_ring_fill, hdr, iov);
+
+		if(!chunk_ready(iov, n, 0) || txring_fill(&m_tx_ring, slot, iov, n) < 0)
+			break;
+		m_ring_fill++;
+	}
+}
+
+/*
+ * A new chunk went out with sendmsg() because its frame was not in the
+ * ring, it was not decompressed yet or too large for a slot. The ring
+ * head did not move, so the next chunk goes into the head slot.
+ */
+static void ring_rebase(const t_peer *peer, int index) {
+	unsigned int frames = m_tx_ring.frames;
+
+	m_ring_base = (m_tx_ring.head + frames - (unsigned int)(index + 1) % frames) % frames;
+	m_ring_fill = index + 1;
+	ring_prefill(peer);
+}
+
+/*
+ * Send a chunk of the transfer: from the TX ring if its frame is ready,
+ * with sendmsg() otherwise. Retransmissions always use sendmsg(), the
+ * ring only ever moves forward. Only a single upload uses the ring.
+ */
+static int queue_chunk(t_peer *peer, int index) {
+	int ret;
+
+	if(index < peer->sent)
+		return send_chunk(peer, index);
+	peer->sent = index + 1;
+
+	if(peer->ring && m_tx_ring.map && index < m_ring_fill) {
+		unsigned int slot = (m_ring_base + index) % m_tx_ring.frames;
+
+		if(m_opts.verbose)
+			print_chunk(peer, index);
+		if(m_capture) {
+			uint8_t hdr[WASP2_HEADER_LEN];
+			struct iovec iov[1 + WASP2_CHUNK_IOV];
+
+			capture_packet(m_capture, iov, chunk_iov(peer, index, hdr, iov), CAPTURE_OUT);
+		}
+		if(txring_send(&m_tx_ring, slot) == 0) {
+			ring_prefill(peer);
+			return 0;
+		}
+		fprintf(stderr, "TX ring out of sync, falling back to sendmsg().\n");
+		txring_close(&m_tx_ring);
+	}
+
+	ret = send_chunk(peer, index);
+	if(ret == 0 && peer->ring && m_tx_ring.map)
+		ring_rebase(peer, index);
+	return ret;
+}
+
+/*
+ * Attach a classic BPF program to the listener that only passes stage 2
+ * frames from other hosts, optionally only those sent by mac. Everything
+ * else is dropped in the kernel without waking us up.
+ */
+static int attach_filter(int sockfd, const uint8_t *mac) {
+	struct sock_filter code[12];
+	struct sock_fprog prog;
+	int jumps[4];
+	int n = 0, nj = 0, i;
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	jumps[nj++] = n;
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12);
+	jumps[nj++] = n;
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHER_TYPE, 0, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, sizeof(struct ether_header));
+	jumps[nj++] = n;
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_START, 0, 0);
+	if(mac) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 6);
+		jumps[nj++] = n;
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			(uint32_t)mac[0] << 24 | mac[1] << 16 | mac[2] << 8 | mac[3], 0, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 10);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			mac[4] << 8 | mac[5], 0, 1);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	/* Outgoing frames are dropped on a match, everything else on a mismatch */
+	code[jumps[0]].jt = n - 1 - (jumps[0] + 1);
+	for(i = 1; i < nj; i++)
+		code[jumps[i]].jf = n - 1 - (jumps[i] + 1);
+
+	prog.len = n;
+	prog.filter = code;
+	if(setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		perror("SO_ATTACH_FILTER");
+		return -1;
+	}
+	return 0;
+}
+
+/* Only listen to this WASP from now on, a server keeps listening to all */
+static void narrow_filter(const uint8_t *mac) {
+	if(m_opts.server || m_filter_narrowed)
+		return;
+	if(attach_filter(m_sockfd, mac) == 0)
+		m_filter_narrowed = 1;
+}
+
+/* Frames received on the interface so far, -1 if unknown */
+static long long iface_rx_packets(void) {
+	char path[64 + IFNAMSIZ];
+	long long count = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets", m_opts.iface);
+	fp = fopen(path, "r");
+	if(!fp)
+		return -1;
+	if(fscanf(fp, "%lld", &count) != 1)
+		count = -1;
+	fclose(fp);
+	return count;
+}
+
+/*
+ * The chunk cache holds one "<model> <bytes>" line per model. Without an
+ * entry for the model the chunk size is probed from scratch.
+ */
+static int chunk_cache_load(const char *filename, const char *model) {
+	char line[64], name[32];
+	int size, hint = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if(!fp)
+		return 0;
+	while(fgets(line, sizeof(line), fp)) {
+		if(sscanf(line, "%31s %d", name, &size) == 2 && strcmp(name, model) == 0)
+			hint = size;
+	}
+	fclose(fp);
+	return hint;
+}
+
+typedef struct {
+	const char *filename;
+	const char *model;
+	int size;
+} t_chunk_cache;
+
+/* Copy the entries of the other models and put ours last */
+static int chunk_cache_write(FILE *out, void *arg) {
+	const t_chunk_cache *c = arg;
+	char line[64], name[32];
+	FILE *in;
+
+	in = fopen(c->filename, "r");
+	if(in) {
+		while(fgets(line, sizeof(line), in)) {
+			if(sscanf(line, "%31s", name) == 1 && strcmp(name, c->model) != 0)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s %d\n", c->model, c->size);
+	return 0;
+}
+
+static int chunk_cache_store(const char *filename, const char *model, int size) {
+	t_chunk_cache c;
+
+	c.filename = filename;
+	c.model = model;
+	c.size = size;
+	if(file_replace(filename, "w", chunk_cache_write, &c) < 0) {
+		perror(filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Keep what the WASP accepted for the next upload to the same model */
+static void chunk_cache_update(const t_peer *peer) {
+	const char *model = m_opts.model ? m_opts.model : CHUNK_CACHE_DEFAULT;
+	t_wasp2_stats stats;
+
+	wasp2_get_stats(peer->sm, &stats);
+	if(!stats.chunk_size)
+		return;
+	if(!m_opts.server)
+		printf("Negotiated a chunk size of %lu bytes.\n", stats.chunk_size);
+	if(!m_opts.chunk_cache || (int)stats.chunk_size == m_chunk_hint)
+		return;
+	if(chunk_cache_store(m_opts.chunk_cache, model, stats.chunk_size) == 0)
+		m_chunk_hint = stats.chunk_size;
+}
+
+/*
+ * Chunks that fit into the interface MTU next to the WASP header and the
+ * load address in front of the firmware.
+ */
+static int iface_max_chunk(void) {
+	struct ifreq ifr;
+	int max_chunk;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, m_opts.iface, IFNAMSIZ-1);
+	if(ioctl(m_sockfd, SIOCGIFMTU, &ifr) < 0) {
+		perror("SIOCGIFMTU");
+		return 0;
+	}
+	max_chunk = ifr.ifr_mtu - WASP_HEADER_LEN - sizeof(uint32_t);
+	if(max_chunk > WASP2_MAX_CHUNK)
+		max_chunk = WASP2_MAX_CHUNK;
+	if(max_chunk <= CHUNK_SIZE) {
+		printf("The MTU of %d bytes leaves no room for larger chunks.\n", ifr.ifr_mtu);
+		return 0;
+	}
+	return max_chunk & ~3;
+}
+
+void stage2_default_options(t_stage2_options *opts) {
+	memset(opts, 0, sizeof(*opts));
+	opts->ack_timeout = ACK_TIMEOUT_MS;
+	opts->retries = ACK_RETRIES;
+	opts->total_timeout = TOTAL_TIMEOUT_S;
+	opts->window = 1;
+}
+
+/*
+ * Everything that does not need the WASP: load the images, then open,
+ * filter and bind the socket. From here on frames sent by the WASP are
+ * queued on the socket until stage2_run() picks them up.
+ */
+int stage2_prepare(const t_stage2_options *opts) {
+	struct sockaddr_ll addr;
+	struct packet_mreq mreq;
+	struct ifreq if_mac;
+	struct stat st;
+	int sockopt = 1;
+	int compressed;
+
+	m_opts = *opts;
+	if(m_opts.window < 1)
+		m_opts.window = 1;
+	if(m_opts.window > WASP2_MAX_WINDOW)
+		m_opts.window = WASP2_MAX_WINDOW;
+	if(opts->report)
+		m_report = opts->report;
+	m_capture = opts->capture;
+
+	if(m_opts.config && stat(m_opts.config, &st) == 0 && S_ISDIR(st.st_mode)) {
+		int cached = config_build(&m_config, m_opts.config, m_opts.config_cache);
+
+		if(cached < 0)
+			return -1;
+		printf("Config archive: %zu bytes, %s\n", m_config.size,
+			cached ? "unchanged, from the cache" : "built");
+	} else if(m_opts.config) {
+		if(image_load(&m_config, m_opts.config, IMAGE_MAP) < 0) {
+			printf("Input file not found: %s\n", m_opts.config);
+			return -1;
+		}
+		image_prefault(&m_config);
+	}
+
+	/* A server starts every WASP from the beginning, it keeps the whole image */
+	compressed = stream_open(&m_stream, &m_firmware, m_opts.filename,
+		m_opts.server ? 0 : STREAM_WINDOW);
+	if(compressed < 0)
+		goto err;
+	if(compressed) {
+		printf("Firmware: %zu bytes, decompressed while sending\n", m_firmware.size);
+	} else {
+		if(image_load(&m_firmware, m_opts.filename, IMAGE_MAP) < 0) {
+			printf("Input file not found: %s\n", m_opts.filename);
+			goto err;
+		}
+		image_prefault(&m_firmware);
+	}
+
+	/*
+	 * Open PF_PACKET socket. It does not receive anything until it is
+	 * bound to EtherType ETHER_TYPE below, after the filter is in place.
+	 */
+	if ((m_sockfd = socket(PF_PACKET, SOCK_RAW, 0)) == -1) {
+		perror("listener: socket");
+		goto err;
+	}
+
+	if (attach_filter(m_sockfd, NULL) < 0)
+		goto err;
+
+	/* Allow the socket to be reused - incase connection is closed prematurely */
+	if (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof sockopt) == -1) {
+		perror("setsockopt");
+		goto err;
+	}
+
+	/* Bind to device */
+	if (setsockopt(m_sockfd, SOL_SOCKET, SO_BINDTODEVICE, m_opts.iface, IFNAMSIZ-1) == -1)	{
+		perror("SO_BINDTODEVICE");
+		goto err;
+	}
+
+	/* Packet sockets ignore SO_BINDTODEVICE, only bind() restricts them */
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETHER_TYPE);
+	addr.sll_ifindex = m_ifindex = if_nametoindex(m_opts.iface);
+	if (bind(m_sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		goto err;
+	}
+	m_rx_start = iface_rx_packets();
+
+	/*
+	 * The WASP talks to our own MAC, promiscuous mode is only needed if a
+	 * switch in between gets in the way. The kernel drops the membership,
+	 * and restores the interface flags, when the socket is closed.
+	 */
+	if (m_opts.promisc) {
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.mr_ifindex = m_ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(m_sockfd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+			perror("PACKET_ADD_MEMBERSHIP");
+	}
+
+	/* Get the MAC address of the interface to send on */
+	memset(&if_mac, 0, sizeof(struct ifreq));
+	strncpy(if_mac.ifr_name, m_opts.iface, IFNAMSIZ-1);
+	if (ioctl(m_sockfd, SIOCGIFHWADDR, &if_mac) < 0) {
+		perror("SIOCGIFHWADDR");
+		goto err;
+	}
+	memcpy(m_own_mac, if_mac.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	m_max_chunk = 0;
+	m_chunk_hint = 0;
+	if(m_opts.negotiate) {
+		m_max_chunk = iface_max_chunk();
+		if(m_max_chunk && m_opts.chunk_cache)
+			m_chunk_hint = chunk_cache_load(m_opts.chunk_cache,
+				m_opts.model ? m_opts.model : CHUNK_CACHE_DEFAULT);
+		if(m_chunk_hint)
+			printf("Chunk size from the cache: %d bytes\n", m_chunk_hint);
+	}
+
+	/* A server interleaves many transfers, the ring only serves one */
+	if(m_opts.tx_ring && m_opts.server)
+		fprintf(stderr, "The TX ring is not used in server mode.\n");
+	else if(m_opts.tx_ring && txring_open(&m_tx_ring, m_ifindex, TXRING_FRAMES) < 0)
+		fprintf(stderr, "Could not set up the TX ring, using sendmsg().\n");
+
+	return 0;
+
+err:
+	stage2_close();
+	return -1;
+}
+
+/* Carry out what the peer's state machine asks for */
+static t_peer_status peer_action(t_peer *peer, const t_wasp2_action *act) {
+	int i;
+
+	/* Before anything is sent, in case acknowledged data is needed again */
+	stream_release(&m_stream, wasp2_acked(peer->sm));
+	if(act->debug && m_opts.verbose)
+		peer_log(peer, act->debug);
+	if(act->rtt_ns)
+		report_rtt(m_report, act->rtt_ns);
+	if(act->started) {
+		narrow_filter(peer->mac);
+		peer->sent = 0;
+		if(peer->ring && m_tx_ring.map) {
+			m_ring_base = m_tx_ring.head;
+			m_ring_fill = 0;
+			ring_prefill(peer);
+		}
+	}
+	/* Frames prebuilt for chunks that were cut anew are stale */
+	if(act->resized && peer->ring && m_tx_ring.map) {
+		if(m_ring_fill > peer->sent)
+			m_ring_fill = peer->sent;
+		ring_prefill(peer);
+	}
+	set_phase(act->phase);
+	/* Round up, waking early would only spin until the deadline */
+	peer->deadline = act->deadline ? (act->deadline + 999999) / 1000000 : 0;
+
+	switch(act->type) {
+	case WASP2_ACT_SEND:
+		for(i = act->first; i < act->first + act->count; i++) {
+			int ret = queue_chunk(peer, i);
+
+			if(ret < 0)
+				return PEER_FAILED;
+			if(ret != 0) {
+				fprintf(stderr, "Error sending packet.\n");
+				break;
+			}
+		}
+		break;
+	case WASP2_ACT_DONE:
+		if(act->msg)
+			peer_log(peer, act->msg);
+		chunk_cache_update(peer);
+		if(!m_opts.server)
+			report_end(m_report);
+		return PEER_DONE;
+	case WASP2_ACT_FAILED:
+		if(act->msg)
+			fprintf(stderr, "%s\n", act->msg);
+		return PEER_FAILED;
+	default:
+		break;
+	}
+	if(act->msg)
+		peer_log(peer, act->msg);
+	return PEER_BUSY;
+}
+
+/*
+ * Handle a frame from the peer's WASP. Returns PEER_DONE once the
+ * firmware, and the config if there is one, are uploaded.
+ */
+static t_peer_status peer_frame(t_peer *peer, const t_wasp_packet *packet, size_t len) {
+	return peer_action(peer, wasp2_frame(peer->sm, packet->data, len, now_ns()));
+}
+
+/* Retransmit if the peer's ACK is overdue, returns PEER_FAILED if it gave up */
+static t_peer_status peer_timeout(t_peer *peer, uint64_t now) {
+	if(!peer->deadline || now < peer->deadline)
+		return PEER_BUSY;
+	return peer_action(peer, wasp2_timer(peer->sm, now_ns()));
+}
+
+/*
+ * Wait for the next stage 2 frame until the deadline (ms, 0 for none).
+ * Returns the frame length, 0 on timeout or -1 on error.
+ */
+static ssize_t receive_frame(uint8_t *buf, uint64_t deadline) {
+	struct sockaddr_ll from;
+	socklen_t fromlen = sizeof(from);
+	struct pollfd pfd;
+	ssize_t numbytes;
+	uint64_t now;
+	int timeout = -1;
+	int i;
+
+	pfd.fd = m_sockfd;
+	pfd.events = POLLIN;
+	now = now_ms();
+	if(deadline)
+		timeout = deadline > now ? deadline - now : 0;
+
+	report_syscall(REPORT_SYS_POLL);
+	i = poll(&pfd, 1, timeout);
+	if(i < 0) {
+		if(errno == EINTR)
+			return 0;
+		perror("poll");
+		return -1;
+	}
+	if(i == 0)
+		return 0;
+
+	report_syscall(REPORT_SYS_RECV);
+	numbytes = recvfrom(m_sockfd, buf, BUF_SIZE, 0, (struct sockaddr *)&from, &fromlen);
+	if(numbytes < 0) {
+		if(errno == EINTR || errno == EAGAIN)
+			return 0;
+		perror("recvfrom");
+		return -1;
+	}
+
+	/* The listener also sees the frames we send ourselves */
+	if(from.sll_pkttype == PACKET_OUTGOING)
+		return 0;
+	if(m_capture) {
+		struct iovec iov = { buf, numbytes };
+
+		capture_packet(m_capture, &iov, 1, CAPTURE_IN);
+	}
+	if(m_opts.verbose) {
+		printf("Recv (%ld bytes): ", numbytes);
+		for(int i=0; i<numbytes; i++) {
+			printf("0x%x ", buf[i]);
+		}
+		printf("\n");
+	}
+
+	if(numbytes < 30) {
+		fprintf(stderr, "Packet too small, discarding\n");
+		return 0;
+	}
+	if(((struct ether_header *)buf)->ether_type != htons(ETHER_TYPE))
+		return 0;
+	if(((t_wasp_packet *)(buf + sizeof(struct ether_header)))->packet_start != htons(PACKET_START))
+		return 0;
+	return numbytes;
+}
+
+static void print_socket_stats(void) {
+	struct tpacket_stats stats;
+	socklen_t stats_len = sizeof(stats);
+
+	if(m_opts.verbose && getsockopt(m_sockfd, SOL_PACKET, PACKET_STATISTICS, &stats, &stats_len) == 0) {
+		long long rx_end = iface_rx_packets();
+
+		/* tp_packets includes the frames dropped for lack of buffer space */
+		printf("Delivered %u frames, %u dropped for lack of buffer space",
+			stats.tp_packets - stats.tp_drops, stats.tp_drops);
+		if(m_rx_start >= 0 && rx_end >= m_rx_start)
+			printf(", %lld received frames filtered in the kernel",
+				rx_end - m_rx_start - stats.tp_packets > 0 ? rx_end - m_rx_start - stats.tp_packets : 0);
+		printf(".\n");
+	}
+}
+
+static void handle_stop(int sig) {
+	(void)sig;
+	m_stop = 1;
+}
+
+static t_peer *find_peer(t_peer *peers, int num_peers, const uint8_t *mac) {
+	int i;
+
+	for(i = 0; i < num_peers; i++) {
+		if(memcmp(peers[i].mac, mac, ETH_ALEN) == 0)
+			return &peers[i];
+	}
+	return NULL;
+}
+
+/* Earliest time any peer needs attention, 0 if none does */
+static uint64_t peer_deadline(const t_peer *peer) {
+	uint64_t deadline = 0;
+
+	if(m_opts.total_timeout)
+		deadline = peer->start_ns / 1000000 + m_opts.total_timeout * 1000ull;
+	if(peer->deadline && (!deadline || peer->deadline < deadline))
+		deadline = peer->deadline;
+	return deadline;
+}
+
+static void print_peer_stats(const t_peer *peer) {
+	double secs = (now_ns() - peer->start_ns) / 1e9;
+	t_wasp2_stats stats;
+	char msg[128];
+
+	wasp2_get_stats(peer->sm, &stats);
+	snprintf(msg, sizeof(msg), "%lu bytes in %.3f s (%.1f KB/s), %lu retransmits, %lu stale ACKs",
+		stats.bytes, secs, secs > 0 ? stats.bytes / secs / 1024 : 0, stats.retransmits,
+		stats.duplicate_acks + stats.unexpected_acks);
+	peer_log(peer, msg);
+}
+
+/*
+ * Serve any number of WASPs at once. Each source MAC gets its own
+ * transfer state, all of them share the images and the socket and are
+ * driven from this one loop. A WASP is added on its first discovery
+ * frame and removed once it is done or has failed.
+ */
+static int stage2_serve(void) {
+	uint8_t buf[BUF_SIZE];
+	struct ether_header *eh = (struct ether_header *) buf;
+	t_wasp_packet *packet = (t_wasp_packet *) (buf + sizeof(struct ether_header));
+	t_peer *peers = NULL;
+	int num_peers = 0, max_peers = 0, peak_peers = 0;
+	unsigned long served = 0, failed = 0, bytes = 0;
+	uint64_t start = now_ns();
+	struct sigaction sa;
+	double secs;
+	ssize_t numbytes;
+	int i;
+
+	/* No SA_RESTART, so that poll() returns on a signal */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Serving WASPs on %s, press Ctrl-C to stop.\n", m_opts.iface);
+	while(!m_stop && (!m_opts.max_served || served < (unsigned long)m_opts.max_served)) {
+		uint64_t deadline = 0;
+		uint64_t now;
+		t_peer *peer;
+
+		for(i = 0; i < num_peers; i++) {
+			uint64_t d = peer_deadline(&peers[i]);
+
+			if(d && (!deadline || d < deadline))
+				deadline = d;
+		}
+		numbytes = receive_frame(buf, deadline);
+		if(numbytes < 0)
+			break;
+
+		if(numbytes > 0) {
+			peer = find_peer(peers, num_peers, eh->ether_shost);
+			if(!peer && packet->response == htons(RESP_DISCOVER)) {
+				if(num_peers == max_peers) {
+					int n = max_peers ? max_peers * 2 : 16;
+					t_peer *p = realloc(peers, n * sizeof(*peers));
+
+					if(!p) {
+						fprintf(stderr, "Out of memory, ignoring a new WASP.\n");
+						continue;
+					}
+					peers = p;
+					max_peers = n;
+				}
+				peer = &peers[num_peers];
+				if(peer_init(peer, eh->ether_shost) < 0)
+					continue;
+				num_peers++;
+				peer->start_ns = now_ns();
+				if(num_peers > peak_peers)
+					peak_peers = num_peers;
+			}
+			if(peer)
+				peer->status = peer_frame(peer, packet, numbytes - sizeof(*eh));
+		}
+
+		/* Expire overdue peers and retire the finished ones */
+		now = now_ms();
+		for(i = 0; i < num_peers; i++) {
+			peer = &peers[i];
+			if(peer->status == PEER_BUSY)
+				peer->status = peer_timeout(peer, now);
+			if(peer->status == PEER_BUSY && m_opts.total_timeout &&
+					now >= peer->start_ns / 1000000 + m_opts.total_timeout * 1000ull) {
+				peer_log(peer, "Timed out.");
+				peer->status = PEER_FAILED;
+			}
+			if(peer->status == PEER_BUSY)
+				continue;
+
+			if(peer->status == PEER_DONE) {
+				t_wasp2_stats stats;
+
+				print_peer_stats(peer);
+				wasp2_get_stats(peer->sm, &stats);
+				served++;
+				bytes += stats.bytes;
+			} else {
+				peer_log(peer, "Upload failed.");
+				failed++;
+			}
+			peer_free(peer);
+			peers[i--] = peers[--num_peers];
+		}
+	}
+
+	secs = (now_ns() - start) / 1e9;
+	printf("Served %lu WASPs, %lu failed, %d still in progress, at most %d at once.\n",
+		served, failed, num_peers, peak_peers);
+	printf("Uploaded %lu bytes in %.3f s (%.2f MB/s).\n",
+		bytes, secs, secs > 0 ? bytes / secs / (1024 * 1024) : 0);
+	print_socket_stats();
+	for(i = 0; i < num_peers; i++)
+		peer_free(&peers[i]);
+	free(peers);
+
+	return failed || num_peers ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Serve the WASP until both images are uploaded, returns an exit status */
+int stage2_run(void) {
+	uint8_t buf[BUF_SIZE];
+	struct ether_header *eh = (struct ether_header *) buf;
+	t_wasp_packet *packet = (t_wasp_packet *) (buf + sizeof(struct ether_header));
+	static const uint8_t default_mac[ETH_ALEN] = {0x00, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa};
+	t_peer *peer = &m_peer;
+	t_peer_status status = PEER_BUSY;
+	uint64_t total_deadline = 0;
+	t_wasp2_stats stats;
+	ssize_t numbytes;
+	int discovered = 0;
+
+	if(m_opts.server)
+		return stage2_serve();
+
+	if(peer_init(peer, default_mac) < 0)
+		return EXIT_FAILURE;
+	set_phase("discovery");
+	/* A WASP that never shows up fails, so that it can be reset */
+	if(m_opts.total_timeout)
+		total_deadline = now_ms() + m_opts.total_timeout * 1000ull;
+
+	while(status == PEER_BUSY) {
+		uint64_t deadline = total_deadline;
+		uint64_t now;
+
+		if(peer->deadline && (!deadline || peer->deadline < deadline))
+			deadline = peer->deadline;
+		numbytes = receive_frame(buf, deadline);
+		if(numbytes < 0)
+			break;
+
+		now = now_ms();
+		if(numbytes == 0) {
+			if(total_deadline && now >= total_deadline) {
+				if(discovered)
+					fprintf(stderr, "Timed out, the transfer took longer than %d s.\n",
+						m_opts.total_timeout);
+				else
+					fprintf(stderr, "Timed out waiting for the WASP.\n");
+				break;
+			}
+			status = peer_timeout(peer, now);
+			continue;
+		}
+
+		/*
+		 * The transfer starts over with the first frame of the WASP,
+		 * however long it took to boot, as in server mode
+		 */
+		if(!discovered) {
+			discovered = 1;
+			if(m_opts.total_timeout)
+				total_deadline = now + m_opts.total_timeout * 1000ull;
+		}
+
+		/* Whoever talks to us is the WASP, until the filter is narrowed */
+		memcpy(peer->mac, eh->ether_shost, ETH_ALEN);
+		memcpy(peer->eth_header.ether_dhost, peer->mac, ETH_ALEN);
+		status = peer_frame(peer, packet, numbytes - sizeof(*eh));
+	}
+	print_socket_stats();
+	if(m_tx_ring.sent)
+		printf("Sent %lu frames from the TX ring.\n", m_tx_ring.sent);
+	wasp2_get_stats(peer->sm, &stats);
+	if(stats.retransmits)
+		printf("Retransmitted %lu packets.\n", stats.retransmits);
+	if(stats.duplicate_acks || stats.unexpected_acks)
+		printf("Ignored %lu duplicate ACKs, %lu ACKs for packets never sent.\n",
+			stats.duplicate_acks, stats.unexpected_acks);
+	if(m_stream.waits || m_stream.restarts)
+		printf("Waited %lu times for the decompressed firmware, decompressed it again %lu times.\n",
+			m_stream.waits, m_stream.restarts);
+	peer_free(peer);
+
+	return status == PEER_DONE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void stage2_close(void) {
+	stream_close(&m_stream);
+	txring_close(&m_tx_ring);
+	if(m_sockfd >= 0)
+		close(m_sockfd);
+	m_sockfd = -1;
+	image_free(&m_firmware);
+	image_free(&m_config);
+}
@@ -0,0 +1,59 @@
+/*
+ * Stage 2 upload engine for AVM WASP
+ *
+ * The upload is split in two. stage2_prepare() does everything that can
+ * be done before the WASP shows up: it loads the images and opens,
+ * filters and binds the socket. stage2_run() then answers the discovery
+ * frames and uploads the firmware and the config. Frames the WASP sends
+ * in between are queued on the socket and not lost, so the preparation
+ * can run while stage 1 is still being uploaded.
+ *
+ * A gzip or xz compressed firmware is decompressed while it is sent,
+ * see wasp_stream.h.
+ *
+ * With negotiate set, the chunk size is probed up to what fits into the
+ * interface MTU. The result is kept per model in chunk_cache, a later
+ * upload then only tries the size that worked before.
+ *
+ * In server mode stage2_run() serves every WASP on the segment, each with
+ * its own transfer state keyed by its MAC address, until it is stopped
+ * by a signal or has served max_served WASPs.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_STAGE2_UPLOAD_H
+#define WASP_STAGE2_UPLOAD_H
+
+#include "wasp_capture.h"
+#include "wasp_report.h"
+
+typedef struct {
+	const char *iface;
+	const char *filename;
+	const char *config;		/* optional file or directory */
+	const char *config_cache;	/* optional, for a config directory */
+	int verbose;
+	int ack_timeout;		/* ms */
+	int retries;
+	int total_timeout;		/* s, 0 to wait forever */
+	int tx_ring;
+	int window;
+	int strict;			/* trust the echoed ACK counters from the start */
+	int negotiate;			/* probe for chunks up to the link MTU */
+	const char *model;		/* key into chunk_cache */
+	const char *chunk_cache;	/* optional, negotiated chunk sizes per model */
+	int promisc;
+	int server;			/* serve any number of WASPs */
+	int max_served;			/* server exits after this many, 0 for never */
+	t_report *report;		/* optional */
+	t_capture *capture;		/* optional */
+} t_stage2_options;
+
+void stage2_default_options(t_stage2_options *opts);
+int stage2_prepare(const t_stage2_options *opts);
+int stage2_run(void);
+void stage2_close(void);
+
+#endif
@@ -0,0 +1,520 @@
+/*
+ * Stage 1 upload state machine for AVM WASP
+ *
+ * The upload is a fixed sequence of commands: header, checksum and one
+ * command per chunk, each a batch of data register writes and a command
+ * write, then a poll until the WASP answers. After that the stage 1
+ * firmware is started and walked through its boot handshake, which
+ * waits for status changes of the booting firmware.
+ *
+ * The handshake waits run on absolute deadlines from the start of the
+ * wait: a fast phase right after the command, when the answer usually
+ * comes, then a backoff to a short maximum interval. A wait never drifts
+ * with the time spent reading, and gives up after a fixed time instead
+ * of a number of reads.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwasp.h"
+#include "wasp_stage1.h"
+#include "wasp_plan.h"
+
+#define POLL_SLEEP_NS		100000ull
+#define WAIT_FAST_NS		100000ull		/* read interval in the fast phase */
+#define WAIT_FAST_FOR_NS	2000000ull
+#define WAIT_MAX_NS			500000ull
+/* As long as the original 1000 status reads, 10 or 20 ms apart */
+#define WAIT_TIMEOUT_NS		10000000000ull
+#define WAIT_LONG_TIMEOUT_NS	20000000000ull
+
+typedef enum {
+	S_READY,
+	S_READY_ZERO,
+	S_HEADER,
+	S_CHECKSUM,
+	S_CHUNK,
+	S_START,
+	S_WAIT_READY,
+	S_START2,
+	S_ROUND_WAIT,
+	S_ROUND_DATA1,
+	S_ROUND_DATA2,
+	S_ROUND_ACK,
+	S_WAIT_START,
+	S_START3,
+	S_CHECK_START,
+	S_WAIT_MAC,
+	S_MAC,
+	S_DONE,
+	S_FAILED
+} t_state;
+
+/* Where a command is: written, or polled on the zero or status register */
+typedef enum {
+	CMD_WRITE,
+	CMD_POLL_ZERO,
+	CMD_POLL_STATUS
+} t_cmd_stage;
+
+struct t_wasp1 {
+	const t_plan *plan;
+	t_plan own_plan;
+	t_model model;
+	uint16_t reg_zero;
+	uint16_t reg_status;
+	t_state state;
+	t_cmd_stage cmd;
+	uint32_t chunk;
+	int polls;
+	uint64_t wait_start;
+	uint64_t wait_next;
+	uint64_t wait_interval;
+	int cont;
+	int data1;
+	unsigned long handshake_polls;
+	t_wasp1_action act;
+	char msg[80];
+};
+
+static const uint8_t mac_data[CHUNK_SIZE] = {0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0x04, 0x20, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+static const char *state_phase(t_state state) {
+	switch(state) {
+	case S_READY:
+	case S_READY_ZERO:
+		return "ready";
+	case S_HEADER:
+		return "header";
+	case S_CHECKSUM:
+		return "checksum";
+	case S_CHUNK:
+	case S_START:
+		return "chunks";
+	case S_WAIT_READY:
+	case S_START2:
+		return "wait_ready_to_start";
+	case S_ROUND_WAIT:
+	case S_ROUND_DATA1:
+	case S_ROUND_DATA2:
+	case S_ROUND_ACK:
+		return "boot_rounds";
+	case S_WAIT_START:
+	case S_START3:
+	case S_CHECK_START:
+		return "wait_start";
+	case S_WAIT_MAC:
+		return "wait_mac";
+	case S_MAC:
+		return "mac";
+	default:
+		return "done";
+	}
+}
+
+static void act_reset(t_wasp1 *sm, t_wasp1_act type, uint64_t deadline) {
+	const char *msg = sm->act.msg;
+
+	memset(&sm->act, 0, sizeof(sm->act));
+	sm->act.type = type;
+	sm->act.deadline = deadline;
+	sm->act.phase = state_phase(sm->state);
+	/* A message set while advancing belongs to the next action */
+	sm->act.msg = msg;
+}
+
+static const t_wasp1_action *fail(t_wasp1 *sm, const char *fmt, int value) {
+	snprintf(sm->msg, sizeof(sm->msg), fmt, value);
+	sm->state = S_FAILED;
+	act_reset(sm, WASP1_ACT_FAILED, 0);
+	sm->act.msg = sm->msg;
+	return &sm->act;
+}
+
+static void emit_read(t_wasp1 *sm, int location, uint64_t deadline) {
+	act_reset(sm, WASP1_ACT_READ, deadline);
+	sm->act.location = location;
+}
+
+static void emit_poll(t_wasp1 *sm, int location, uint64_t now) {
+	act_reset(sm, WASP1_ACT_READ, now + POLL_SLEEP_NS);
+	sm->act.location = location;
+	sm->act.poll = 1;
+	sm->act.expected = RESP_OK;
+}
+
+static void add_write(t_wasp1 *sm, int location, int value, int flags) {
+	t_wasp1_write *w = &sm->act.writes[sm->act.count++];
+
+	w->location = location;
+	w->value = value;
+	w->flags = flags;
+}
+
+static void emit_write(t_wasp1 *sm, int location, int value, uint64_t now) {
+	act_reset(sm, WASP1_ACT_WRITE, now);
+	add_write(sm, location, value, 0);
+}
+
+static void emit_data(t_wasp1 *sm, const uint16_t *regs, int count, int command, uint64_t now) {
+	int i;
+
+	act_reset(sm, WASP1_ACT_WRITE, now);
+	sm->act.batch = 1;
+	for(i = 0; i < count; i++)
+		add_write(sm, REG_DATA(sm->reg_status, i + 1), regs[i], WASP1_WRITE_DATA);
+	add_write(sm, sm->reg_status, command, 0);
+}
+
+static void emit_mac(t_wasp1 *sm, uint64_t now) {
+	uint16_t regs[PLAN_REGS];
+	int i;
+
+	for(i = 0; i < CHUNK_SIZE; i += 2)
+		regs[i / 2] = (mac_data[i] << 8) | mac_data[i + 1];
+	emit_data(sm, regs, PLAN_REGS, CMD_SET_DATA, now);
+}
+
+/* Write the command of the current state */
+static void emit_command(t_wasp1 *sm, uint64_t now) {
+	const t_plan *plan = sm->plan;
+	uint16_t regs[PLAN_REGS];
+
+	sm->cmd = CMD_WRITE;
+	switch(sm->state) {
+	case S_HEADER:
+		regs[0] = plan->start_addr >> 16;
+		regs[1] = plan->start_addr;
+		regs[2] = plan->size >> 16;
+		regs[3] = plan->size;
+		regs[4] = plan->exec_addr >> 16;
+		regs[5] = plan->exec_addr;
+		emit_data(sm, regs, 6, CMD_SET_PARAMS, now);
+		break;
+	case S_CHECKSUM:
+		regs[0] = plan->checksum >> 16;
+		regs[1] = plan->checksum;
+		if(sm->model == MODEL_3390) {
+			regs[2] = 0;
+			regs[3] = 0;
+			emit_data(sm, regs, 4, CMD_SET_CHECKSUM_3390, now);
+		} else {
+			emit_data(sm, regs, 2, CMD_SET_CHECKSUM_3490, now);
+		}
+		break;
+	case S_CHUNK:
+		emit_data(sm, plan->regs[sm->chunk], plan_chunk_regs(plan, sm->chunk), CMD_SET_DATA, now);
+		break;
+	default:
+		emit_mac(sm, now);
+		break;
+	}
+}
+
+/* Start waiting for the booting firmware to show the expected status */
+static void emit_wait(t_wasp1 *sm, t_state state, uint64_t now) {
+	sm->state = state;
+	sm->wait_start = now;
+	sm->wait_next = now;
+	sm->wait_interval = WAIT_FAST_NS;
+	emit_read(sm, sm->reg_status, now);
+}
+
+static int wait_expected(const t_wasp1 *sm) {
+	return sm->state == S_WAIT_READY ? RESP_READY_TO_START : RESP_OK;
+}
+
+/* Waiting for the firmware to start and for the MAC request takes longer */
+static uint64_t wait_timeout(const t_wasp1 *sm) {
+	return (sm->state == S_WAIT_READY || sm->state == S_WAIT_MAC) ?
+		WAIT_LONG_TIMEOUT_NS : WAIT_TIMEOUT_NS;
+}
+
+/* Deadline of the next status read of a wait */
+static uint64_t wait_next(t_wasp1 *sm, uint64_t now) {
+	if(sm->wait_next - sm->wait_start >= WAIT_FAST_FOR_NS && sm->wait_interval < WAIT_MAX_NS) {
+		sm->wait_interval *= 2;
+		if(sm->wait_interval > WAIT_MAX_NS)
+			sm->wait_interval = WAIT_MAX_NS;
+	}
+	sm->wait_next += sm->wait_interval;
+	/* After a late read go on from now, catching up would only burst */
+	if(sm->wait_next < now)
+		sm->wait_next = now;
+	return sm->wait_next;
+}
+
+/* Continue after the command of the current state was answered */
+static void command_done(t_wasp1 *sm, uint64_t now) {
+	switch(sm->state) {
+	case S_HEADER:
+		sm->state = S_CHECKSUM;
+		emit_command(sm, now);
+		break;
+	case S_CHECKSUM:
+		sm->state = S_CHUNK;
+		sm->chunk = 0;
+		emit_command(sm, now);
+		break;
+	case S_CHUNK:
+		if(++sm->chunk < sm->plan->chunks) {
+			emit_command(sm, now);
+			break;
+		}
+		sm->state = S_START;
+		sm->act.msg = "Done uploading firmware.";
+		act_reset(sm, WASP1_ACT_WRITE, now);
+		add_write(sm, sm->reg_status, sm->model == MODEL_3490 ?
+			CMD_START_FIRMWARE_3490 : CMD_START_FIRMWARE_3390, 0);
+		/* The booting firmware owns the registers from now on */
+		sm->act.invalidate = 1;
+		break;
+	default:
+		sm->state = S_DONE;
+		sm->act.msg = "Firmware upload successful!";
+		act_reset(sm, WASP1_ACT_DONE, now);
+		break;
+	}
+}
+
+static const t_wasp1_action *command_answer(t_wasp1 *sm, t_wasp1_ev ev, int value, uint64_t now) {
+	static const char *what[] = {
+		[S_HEADER] = "header", [S_CHECKSUM] = "checksum",
+		[S_CHUNK] = "chunk", [S_MAC] = "MAC address"
+	};
+	int lenient = (sm->state == S_CHUNK || sm->state == S_MAC);
+
+	/* Single reads: keep polling like the fixed strategy does */
+	if(ev == WASP1_EV_READ && value != RESP_OK && ++sm->polls < MDIO_TIMEOUT_COUNT) {
+		emit_poll(sm, sm->act.location, now);
+		return &sm->act;
+	}
+	if(value != RESP_OK && !(lenient && (value == RESP_WAIT || value == RESP_COMPLETED))) {
+		char fmt[64];
+
+		snprintf(fmt, sizeof(fmt), "Error writing %s! reg %s = 0x%%x", what[sm->state],
+			sm->cmd == CMD_POLL_ZERO ? "zero" : "status");
+		return fail(sm, fmt, value);
+	}
+
+	sm->polls = 0;
+	if(sm->cmd == CMD_POLL_ZERO) {
+		sm->cmd = CMD_POLL_STATUS;
+		emit_poll(sm, sm->reg_status, now);
+	} else {
+		command_done(sm, now);
+	}
+	return &sm->act;
+}
+
+static const t_wasp1_action *wait_answer(t_wasp1 *sm, int value, uint64_t now) {
+	sm->handshake_polls++;
+	if(value != wait_expected(sm)) {
+		if(now - sm->wait_start >= wait_timeout(sm))
+			return fail(sm, "Timed out waiting for response (0x%x).", value);
+		emit_read(sm, sm->reg_status, wait_next(sm, now));
+		return &sm->act;
+	}
+
+	switch(sm->state) {
+	case S_WAIT_READY:
+		sm->state = S_START2;
+		emit_write(sm, sm->reg_status, sm->model == MODEL_3390 ?
+			CMD_START_FIRMWARE_3390 : CMD_SET_CHECKSUM_3490, now);
+		break;
+	case S_ROUND_WAIT:
+		sm->state = S_ROUND_DATA1;
+		emit_read(sm, REG_DATA(sm->reg_status, 1), now);
+		break;
+	case S_WAIT_START:
+		sm->state = S_START3;
+		emit_write(sm, REG_DATA(sm->reg_status, 1), 0x00, now);
+		add_write(sm, sm->reg_status, CMD_START_FIRMWARE2_3490, 0);
+		break;
+	default:
+		sm->state = S_MAC;
+		sm->cmd = CMD_WRITE;
+		emit_mac(sm, now);
+		break;
+	}
+	return &sm->act;
+}
+
+static const t_wasp1_action *read_answer(t_wasp1 *sm, t_wasp1_ev ev, int value, uint64_t now) {
+	switch(sm->state) {
+	case S_READY:
+	case S_READY_ZERO:
+		if(value != RESP_OK)
+			return fail(sm, "Error: WASP not ready (0x%x)", value);
+		if(sm->state == S_READY && sm->model == MODEL_3390) {
+			sm->state = S_READY_ZERO;
+			emit_read(sm, sm->reg_zero, now);
+		} else {
+			sm->state = S_HEADER;
+			emit_command(sm, now);
+		}
+		break;
+	case S_HEADER:
+	case S_CHECKSUM:
+	case S_CHUNK:
+	case S_MAC:
+		return command_answer(sm, ev, value, now);
+	case S_WAIT_READY:
+	case S_ROUND_WAIT:
+	case S_WAIT_START:
+	case S_WAIT_MAC:
+		return wait_answer(sm, value, now);
+	case S_ROUND_DATA1:
+		sm->data1 = value;
+		sm->state = S_ROUND_DATA2;
+		emit_read(sm, REG_DATA(sm->reg_status, 2), now);
+		break;
+	case S_ROUND_DATA2:
+		if(sm->data1 == 0 && value != 0)
+			sm->cont = value;
+		else
+			sm->cont--;
+		sm->state = S_ROUND_ACK;
+		emit_write(sm, sm->reg_status, CMD_SET_CHECKSUM_3490, now);
+		break;
+	case S_CHECK_START:
+		if(value != RESP_OK)
+			return fail(sm, "Error starting firmware: 0x%x", value);
+		sm->state = S_DONE;
+		sm->act.msg = "Firmware upload successful!";
+		act_reset(sm, WASP1_ACT_DONE, now);
+		break;
+	default:
+		return fail(sm, "Unexpected register read (0x%x)", value);
+	}
+	return &sm->act;
+}
+
+static const t_wasp1_action *write_answer(t_wasp1 *sm, uint64_t now) {
+	switch(sm->state) {
+	case S_HEADER:
+	case S_CHECKSUM:
+	case S_CHUNK:
+	case S_MAC:
+		sm->polls = 0;
+		if(sm->model == MODEL_3390) {
+			sm->cmd = CMD_POLL_ZERO;
+			emit_poll(sm, sm->reg_zero, now);
+		} else {
+			sm->cmd = CMD_POLL_STATUS;
+			emit_poll(sm, sm->reg_status, now);
+		}
+		break;
+	case S_START:
+		sm->act.msg = "Firmware start command sent.";
+		emit_wait(sm, S_WAIT_READY, now);
+		break;
+	case S_START2:
+		sm->act.msg = "Firmware start command sent.";
+		if(sm->model == MODEL_3490) {
+			sm->cont = 1;
+			emit_wait(sm, S_ROUND_WAIT, now);
+		} else {
+			emit_wait(sm, S_WAIT_MAC, now);
+		}
+		break;
+	case S_ROUND_ACK:
+		emit_wait(sm, sm->cont ? S_ROUND_WAIT : S_WAIT_START, now);
+		break;
+	case S_START3:
+		sm->state = S_CHECK_START;
+		emit_read(sm, sm->reg_status, now);
+		break;
+	default:
+		return fail(sm, "Unexpected register write (%d)", sm->state);
+	}
+	return &sm->act;
+}
+
+const t_wasp1_action *wasp1_step(t_wasp1 *sm, t_wasp1_ev ev, int value, uint64_t now_ns) {
+	if(sm->state == S_DONE || sm->state == S_FAILED)
+		return &sm->act;
+	sm->act.msg = NULL;
+
+	switch(ev) {
+	case WASP1_EV_START:
+		sm->state = S_READY;
+		emit_read(sm, sm->reg_status, now_ns);
+		return &sm->act;
+	case WASP1_EV_READ:
+	case WASP1_EV_POLLED:
+		if(sm->act.type != WASP1_ACT_READ)
+			break;
+		return read_answer(sm, ev, value, now_ns);
+	case WASP1_EV_WRITTEN:
+		if(sm->act.type != WASP1_ACT_WRITE)
+			break;
+		return write_answer(sm, now_ns);
+	case WASP1_EV_ERROR:
+		return fail(sm, "Register access failed (%d)", value);
+	}
+	return fail(sm, "Unexpected event %d", ev);
+}
+
+static t_wasp1 *wasp1_alloc(t_model model) {
+	t_wasp1 *sm = calloc(1, sizeof(*sm));
+
+	if(!sm)
+		return NULL;
+	sm->model = model;
+	sm->reg_zero = REG_ZERO;
+	sm->reg_status = (model == MODEL_3390) ? REG_STATUS_3390 : REG_STATUS_3490;
+	return sm;
+}
+
+t_wasp1 *wasp1_new(const t_plan *plan) {
+	t_wasp1 *sm;
+
+	if(plan->model != MODEL_3390 && plan->model != MODEL_3490)
+		return NULL;
+	sm = wasp1_alloc(plan->model);
+	if(sm)
+		sm->plan = plan;
+	return sm;
+}
+
+t_wasp1 *wasp1_new_image(const char *model, const uint8_t *data, size_t size) {
+	t_model m;
+	t_wasp1 *sm;
+
+	if(strcmp(model, "3390") == 0)
+		m = MODEL_3390;
+	else if(strcmp(model, "3490") == 0)
+		m = MODEL_3490;
+	else
+		return NULL;
+	if(size == 0 || size > 0xffff)
+		return NULL;
+
+	sm = wasp1_alloc(m);
+	if(!sm)
+		return NULL;
+	if(plan_compile(&sm->own_plan, m, data, size, START_ADDR, EXEC_ADDR) < 0) {
+		free(sm);
+		return NULL;
+	}
+	sm->plan = &sm->own_plan;
+	return sm;
+}
+
+unsigned long wasp1_handshake_polls(const t_wasp1 *sm) {
+	return sm->handshake_polls;
+}
+
+void wasp1_free(t_wasp1 *sm) {
+	if(!sm)
+		return;
+	if(sm->plan == &sm->own_plan)
+		plan_free(&sm->own_plan);
+	free(sm);
+}
@@ -0,0 +1,585 @@
+/*
+ * Stage 2 upload state machine for AVM WASP
+ *
+ * The WASP asks for the firmware with a discovery frame, and after
+ * booting it for the config with a config discovery frame. Every chunk
+ * is acknowledged with its counter. Unacknowledged chunks are sent again
+ * after the ACK timeout.
+ *
+ * With a window above 1 the machine first probes whether the WASP
+ * accepts a second frame before the first is acknowledged. If it does,
+ * the window opens for the rest of the session. On any sign of trouble
+ * it drops back to stop-and-wait for good.
+ *
+ * ACKs are matched against the chunks in flight by their counter. An
+ * ACK for a chunk that is already acknowledged is a duplicate, from a
+ * flooding switch or a WASP answering a retransmission, and ignored. An
+ * ACK for a chunk that was never sent means the two sides disagree, the
+ * chunks in flight are sent again right away instead of after the ACK
+ * timeout. Both only apply once the WASP is known to echo the counters,
+ * or from the start in strict mode.
+ *
+ * With a max_chunk above CHUNK_SIZE, every image starts stop-and-wait
+ * with a regular chunk and sends the following ones one size up at a
+ * time. Each size the WASP acknowledges is taken, the first one it
+ * answers with RESP_ERROR or not at all ends the negotiation: that chunk
+ * goes out again at the last accepted size, and the rest of the image is
+ * cut into chunks of it. A probe is never the last chunk, which carries
+ * the load address on top and so must fit the accepted size.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwasp.h"
+#include "wasp_stage2.h"
+
+#define PROBE_WINDOW		2
+/* Chunks sent while negotiating the chunk size, at most */
+#define MAX_PROBES			8
+
+typedef enum {
+	ACK_IGNORED,
+	ACK_ACCEPTED,
+	ACK_RESEND
+} t_ack;
+
+typedef enum {
+	DOWNLOAD_TYPE_UNKNOWN = 0,
+	DOWNLOAD_TYPE_FIRMWARE,
+	DOWNLOAD_TYPE_CONFIG
+} t_download_type;
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+} t_blob;
+
+/*
+ * Chunks base up to next_chunk - 1 are in flight. Chunk i < cut starts at
+ * cut_off[i], from cut on the image is cut into chunks of chunk_size,
+ * except for the last one of last_len bytes.
+ */
+struct t_wasp2 {
+	t_wasp2_params params;
+	t_blob firmware;
+	t_blob config;
+	/* LOAD_ADDR in wire order */
+	uint32_t load_addr;
+
+	t_download_type download_type;
+	const t_blob *image;
+	int num_chunks;
+	int chunk_size;
+	int cut;
+	size_t cut_off[MAX_PROBES + 1];
+	size_t last_len;
+	int negotiating;
+	int accepted;		/* largest chunk size acknowledged for this image */
+	int rejected;		/* probe chunk that failed + 1, 0 for none */
+	int next_chunk;
+	int sent;
+	int base;
+	int window;
+	int probing;
+	int probe_from;		/* chunk the window probe started at */
+	int tolerant;
+	int counter_echo;
+	int resent;			/* chunks in flight resent for an unexpected ACK */
+	int awaiting_ack;
+	int retries;
+	int done;
+	uint64_t ack_deadline;
+	/* Send time of the chunks in flight for the ACK round trip, 0 if resent */
+	uint64_t send_ns[WASP2_MAX_WINDOW];
+	const char *phase;
+	t_wasp2_stats stats;
+	t_wasp2_action act;
+	char debug[96];
+};
+
+static void act_reset(t_wasp2 *sm, t_wasp2_act type) {
+	memset(&sm->act, 0, sizeof(sm->act));
+	sm->act.type = type;
+	sm->act.phase = sm->phase;
+	if(sm->awaiting_ack)
+		sm->act.deadline = sm->ack_deadline;
+}
+
+static size_t chunk_offset(const t_wasp2 *sm, int index) {
+	if(index >= sm->num_chunks)
+		return sm->image->size;
+	if(index == sm->num_chunks - 1)
+		return sm->image->size - sm->last_len;
+	if(index <= sm->cut)
+		return sm->cut_off[index];
+	return sm->cut_off[sm->cut] + (size_t)(index - sm->cut) * sm->chunk_size;
+}
+
+/*
+ * Cut the image from chunk cut on into chunks of chunk_size. The load
+ * address behind the firmware must still fit into the last chunk, if it
+ * does not, a few bytes move into a small chunk of their own before it.
+ */
+static void cut_chunks(t_wasp2 *sm) {
+	size_t rest = sm->image->size - sm->cut_off[sm->cut];
+	size_t n = (rest + sm->chunk_size - 1) / sm->chunk_size;
+
+	sm->last_len = rest - (n - 1) * sm->chunk_size;
+	if(sm->download_type == DOWNLOAD_TYPE_FIRMWARE && sm->chunk_size > CHUNK_SIZE &&
+	   sm->last_len + sizeof(sm->load_addr) > (size_t)sm->chunk_size) {
+		sm->last_len = sm->chunk_size - sizeof(sm->load_addr);
+		n++;
+	}
+	sm->num_chunks = sm->cut + n;
+}
+
+/* Open the window again from the current chunk on */
+static void window_setup(t_wasp2 *sm) {
+	sm->window = 1;
+	sm->probing = 0;
+	sm->probe_from = sm->base;
+	if(sm->params.window > 1 && sm->tolerant == 1) {
+		sm->window = sm->params.window;
+	} else if(sm->params.window > 1 && sm->tolerant < 0) {
+		sm->window = PROBE_WINDOW;
+		sm->probing = 1;
+	}
+}
+
+static void start_download(t_wasp2 *sm, t_download_type type, const t_blob *image) {
+	sm->download_type = type;
+	sm->image = image;
+	sm->chunk_size = CHUNK_SIZE;
+	sm->accepted = CHUNK_SIZE;
+	sm->negotiating = (sm->params.max_chunk > CHUNK_SIZE);
+	sm->rejected = 0;
+	sm->cut = 0;
+	sm->cut_off[0] = 0;
+	cut_chunks(sm);
+	sm->next_chunk = 0;
+	sm->sent = 0;
+	sm->base = 0;
+	sm->resent = 0;
+	sm->awaiting_ack = 0;
+	/* Probes go out one by one, so that a rejected one is the only one */
+	sm->window = 1;
+	sm->probing = 0;
+	if(!sm->negotiating)
+		window_setup(sm);
+}
+
+static void negotiation_end(t_wasp2 *sm) {
+	sm->negotiating = 0;
+	sm->chunk_size = sm->accepted;
+	/* Only a probe tells anything about the WASP */
+	if(sm->download_type == DOWNLOAD_TYPE_FIRMWARE && (sm->accepted > CHUNK_SIZE || sm->rejected))
+		sm->stats.chunk_size = sm->accepted;
+	window_setup(sm);
+}
+
+/*
+ * The chunk at cut was acknowledged, so the WASP takes its size. Move
+ * the cut behind it and pick the size of the next chunk: the hint, or
+ * twice the size, as long as there is enough image left to try it.
+ */
+static void negotiate(t_wasp2 *sm) {
+	int next = sm->params.chunk_hint ? sm->params.chunk_hint : sm->chunk_size * 2;
+	size_t rest;
+
+	sm->accepted = sm->chunk_size;
+	sm->cut_off[sm->cut + 1] = sm->cut_off[sm->cut] + sm->chunk_size;
+	sm->cut++;
+	rest = sm->image->size - sm->cut_off[sm->cut];
+
+	if(next > sm->params.max_chunk)
+		next = sm->params.max_chunk;
+	if(next <= sm->accepted || sm->cut >= MAX_PROBES || rest < 2 * (size_t)next) {
+		if(sm->accepted > CHUNK_SIZE) {
+			snprintf(sm->debug, sizeof(sm->debug), "WASP accepts %d byte chunks.", sm->accepted);
+			sm->act.debug = sm->debug;
+		}
+		negotiation_end(sm);
+	} else {
+		snprintf(sm->debug, sizeof(sm->debug), "Trying %d byte chunks.", next);
+		sm->act.debug = sm->debug;
+		sm->chunk_size = next;
+	}
+	cut_chunks(sm);
+	sm->act.resized = sm->cut;
+}
+
+static int probe_in_flight(const t_wasp2 *sm) {
+	return sm->negotiating && sm->chunk_size > sm->accepted && sm->next_chunk > sm->cut;
+}
+
+/* The WASP did not take the probe, send it again at the accepted size */
+static void probe_failed(t_wasp2 *sm, const char *reason) {
+	snprintf(sm->debug, sizeof(sm->debug), "%s for a %d byte chunk, using %d bytes.",
+		reason, sm->chunk_size, sm->accepted);
+	sm->act.debug = sm->debug;
+	sm->rejected = sm->cut + 1;
+	negotiation_end(sm);
+	cut_chunks(sm);
+	sm->act.resized = sm->cut;
+}
+
+static void window_shrink(t_wasp2 *sm, const char *reason) {
+	if(sm->window > 1) {
+		snprintf(sm->debug, sizeof(sm->debug), "%s, falling back to stop-and-wait.", reason);
+		sm->act.debug = sm->debug;
+	}
+	if(sm->window > 1 || sm->probing)
+		sm->tolerant = 0;
+	sm->window = 1;
+	sm->probing = 0;
+}
+
+/*
+ * Send new chunks while the window has room. The last chunk starts the
+ * firmware, so it is held back until everything else is acknowledged.
+ */
+static void fill_window(t_wasp2 *sm, uint64_t now) {
+	int first = sm->next_chunk;
+
+	while(sm->next_chunk < sm->num_chunks && sm->next_chunk - sm->base < sm->window) {
+		/* The last chunk starts the image, send it once all others are in */
+		if(sm->next_chunk == sm->num_chunks - 1 && sm->base < sm->next_chunk)
+			break;
+		if(sm->next_chunk < sm->sent) {
+			/* Karn: no round trip sample from a resent chunk */
+			sm->send_ns[sm->next_chunk % WASP2_MAX_WINDOW] = 0;
+			sm->stats.retransmits++;
+		} else {
+			sm->sent = sm->next_chunk + 1;
+			sm->send_ns[sm->next_chunk % WASP2_MAX_WINDOW] = now;
+		}
+		sm->stats.sent++;
+		sm->next_chunk++;
+	}
+	sm->awaiting_ack = (sm->base < sm->next_chunk);
+	sm->act.deadline = sm->awaiting_ack ? sm->ack_deadline : 0;
+	if(sm->next_chunk > first) {
+		sm->act.type = WASP2_ACT_SEND;
+		sm->act.first = first;
+		sm->act.count = sm->next_chunk - first;
+	}
+}
+
+/*
+ * The counter is 16 bits wide and wraps after 16384 chunks. Take the
+ * chunk it names as the one nearest to the oldest unacknowledged chunk,
+ * ACKs are never more than a window away from it.
+ */
+static int counter_index(const t_wasp2 *sm, uint16_t counter, int *misaligned) {
+	int16_t delta = (uint16_t)(counter - sm->base * COUNTER_INCR);
+
+	*misaligned = (delta % COUNTER_INCR != 0);
+	return sm->base + delta / COUNTER_INCR;
+}
+
+/* The counter the frame of a chunk carries */
+static uint16_t chunk_counter(int index) {
+	return (uint16_t)(index * COUNTER_INCR);
+}
+
+/*
+ * The WASP echoes the counter of the frame it acknowledges. As it takes
+ * frames strictly in order, an ACK covers all frames before it. Until
+ * an echoed counter has been seen, an ACK outside the window is taken as
+ * one for the oldest frame, which is all stop-and-wait ever needed.
+ * Afterwards, or in strict mode, it is a duplicate and ignored, or an
+ * ACK for a frame never sent, which has the window sent again once.
+ */
+static t_ack handle_ack(t_wasp2 *sm, uint16_t counter, uint64_t now) {
+	int misaligned;
+	int index = counter_index(sm, counter, &misaligned);
+	int unexpected = (misaligned || index >= sm->next_chunk);
+
+	if(unexpected || index < sm->base) {
+		if(sm->counter_echo || sm->params.strict) {
+			if(!unexpected) {
+				sm->stats.duplicate_acks++;
+				return ACK_IGNORED;
+			}
+			sm->stats.unexpected_acks++;
+			if(sm->resent || sm->base >= sm->next_chunk)
+				return ACK_IGNORED;
+			snprintf(sm->debug, sizeof(sm->debug), "Unexpected ACK counter %d, resending from %d",
+				counter, sm->base * COUNTER_INCR);
+			sm->act.debug = sm->debug;
+			sm->resent = 1;
+			return ACK_RESEND;
+		}
+		if(sm->base >= sm->next_chunk)
+			return ACK_IGNORED;
+		window_shrink(sm, "Unexpected ACK counter");
+		index = sm->base;
+	} else if(index > 0) {
+		sm->counter_echo = 1;
+	}
+	if(sm->send_ns[index % WASP2_MAX_WINDOW]) {
+		sm->act.rtt_ns = now - sm->send_ns[index % WASP2_MAX_WINDOW];
+		sm->send_ns[index % WASP2_MAX_WINDOW] = 0;
+	}
+	sm->base = index + 1;
+	sm->resent = 0;
+
+	if(sm->probing && sm->base - sm->probe_from >= PROBE_WINDOW) {
+		snprintf(sm->debug, sizeof(sm->debug), "WASP accepts early frames, using a window of %d.",
+			sm->params.window);
+		sm->act.debug = sm->debug;
+		sm->probing = 0;
+		sm->tolerant = 1;
+		sm->window = sm->params.window;
+	}
+	if(sm->negotiating && index == sm->cut)
+		negotiate(sm);
+	return ACK_ACCEPTED;
+}
+
+/* Send everything from the oldest unacknowledged chunk on again */
+static void go_back(t_wasp2 *sm, uint64_t now) {
+	sm->next_chunk = sm->base;
+	sm->ack_deadline = now + sm->params.ack_timeout * 1000000ull;
+	fill_window(sm, now);
+}
+
+/*
+ * The WASP answers the last chunk with RESP_STARTING. Another one, late
+ * from the firmware while the config is on its way or a duplicate, must
+ * not end the download.
+ */
+static int starting_valid(const t_wasp2 *sm, uint16_t counter) {
+	if(!sm->image || sm->next_chunk < sm->num_chunks)
+		return 0;
+	return !(sm->counter_echo || sm->params.strict) ||
+		counter == chunk_counter(sm->num_chunks - 1);
+}
+
+/*
+ * The WASP repeats its discovery frame until it is answered, and frames
+ * queued while stage 1 was still running arrive in a burst. Once the
+ * first chunk of a download is out, further discovery frames for it are
+ * ignored until that chunk is acknowledged; the retransmission timer
+ * takes care of a lost first chunk.
+ */
+static int discovery_pending(const t_wasp2 *sm, t_download_type type) {
+	return sm->download_type == type && sm->base == 0 && sm->next_chunk > 0;
+}
+
+static const t_wasp2_action *discovery(t_wasp2 *sm, t_download_type type, uint64_t now) {
+	const t_blob *image = (type == DOWNLOAD_TYPE_FIRMWARE) ? &sm->firmware : &sm->config;
+
+	if(discovery_pending(sm, type))
+		return &sm->act;
+	if(type == DOWNLOAD_TYPE_CONFIG && !sm->config.data) {
+		sm->act.msg = "WASP requested a config, but none was given.";
+		return &sm->act;
+	}
+
+	sm->phase = (type == DOWNLOAD_TYPE_FIRMWARE) ? "firmware" : "config";
+	start_download(sm, type, image);
+	snprintf(sm->debug, sizeof(sm->debug), "Got %sdiscovery packet, sending %d chunks.",
+		type == DOWNLOAD_TYPE_CONFIG ? "config " : "", sm->num_chunks);
+	act_reset(sm, WASP2_ACT_NONE);
+	sm->act.debug = sm->debug;
+	sm->act.started = 1;
+	sm->retries = 0;
+	sm->ack_deadline = now + sm->params.ack_timeout * 1000000ull;
+	fill_window(sm, now);
+	return &sm->act;
+}
+
+const t_wasp2_action *wasp2_frame(t_wasp2 *sm, const uint8_t *frame, size_t len, uint64_t now_ns) {
+	const t_wasp_packet *packet = (const t_wasp_packet *)frame;
+	uint16_t response;
+
+	act_reset(sm, sm->done ? WASP2_ACT_DONE : WASP2_ACT_NONE);
+	if(sm->done || len < WASP_HEADER_LEN || packet->packet_start != htons(PACKET_START))
+		return &sm->act;
+
+	response = ntohs(packet->response);
+	if(response == RESP_DISCOVER) {
+		return discovery(sm, DOWNLOAD_TYPE_FIRMWARE, now_ns);
+	} else if(response == RESP_CONFIG) {
+		return discovery(sm, DOWNLOAD_TYPE_CONFIG, now_ns);
+	} else if(response == RESP_OK) {
+		if(!sm->image)
+			return &sm->act;
+		switch(handle_ack(sm, ntohs(packet->counter), now_ns)) {
+		case ACK_ACCEPTED:
+			sm->retries = 0;
+			sm->ack_deadline = now_ns + sm->params.ack_timeout * 1000000ull;
+			fill_window(sm, now_ns);
+			break;
+		case ACK_RESEND:
+			go_back(sm, now_ns);
+			break;
+		default:
+			break;
+		}
+	} else if(response == RESP_ERROR) {
+		if(sm->image && probe_in_flight(sm)) {
+			probe_failed(sm, "Error");
+			go_back(sm, now_ns);
+		} else if(sm->image && sm->rejected &&
+		          ntohs(packet->counter) == chunk_counter(sm->rejected - 1)) {
+			/* Another copy of the rejection, the chunk is on its way again */
+			sm->stats.duplicate_acks++;
+		} else {
+			sm->act.type = WASP2_ACT_FAILED;
+			sm->act.msg = "Received an error packet!";
+		}
+	} else if(response == RESP_STARTING) {
+		if(!starting_valid(sm, ntohs(packet->counter))) {
+			sm->stats.duplicate_acks++;
+			return &sm->act;
+		}
+		sm->awaiting_ack = 0;
+		sm->act.deadline = 0;
+		if(sm->image)
+			sm->stats.bytes += sm->image->size;
+		sm->image = NULL;
+		if(sm->download_type == DOWNLOAD_TYPE_FIRMWARE) {
+			sm->act.msg = "Successfully uploaded stage 2 firmware!";
+			if(sm->config.data) {
+				sm->phase = "config_discovery";
+				sm->act.phase = sm->phase;
+				return &sm->act;
+			}
+		} else {
+			sm->act.msg = "Successfully uploaded config file!";
+		}
+		sm->done = 1;
+		sm->act.type = WASP2_ACT_DONE;
+	} else {
+		sm->act.debug = "Got unknown packet!";
+	}
+	return &sm->act;
+}
+
+const t_wasp2_action *wasp2_timer(t_wasp2 *sm, uint64_t now_ns) {
+	act_reset(sm, sm->done ? WASP2_ACT_DONE : WASP2_ACT_NONE);
+	if(!sm->awaiting_ack || now_ns < sm->ack_deadline)
+		return &sm->act;
+
+	if(probe_in_flight(sm)) {
+		probe_failed(sm, "No ACK");
+		sm->resent = 0;
+		go_back(sm, now_ns);
+		return &sm->act;
+	}
+
+	if(sm->retries >= sm->params.retries) {
+		snprintf(sm->debug, sizeof(sm->debug), "No response after %d retransmissions, giving up.",
+			sm->retries);
+		sm->act.type = WASP2_ACT_FAILED;
+		sm->act.msg = sm->debug;
+		return &sm->act;
+	}
+	sm->retries++;
+	window_shrink(sm, "ACK timeout");
+	if(!sm->act.debug) {
+		snprintf(sm->debug, sizeof(sm->debug), "Timeout, retransmitting packet %d",
+			sm->base * COUNTER_INCR);
+		sm->act.debug = sm->debug;
+	}
+	sm->resent = 0;
+	go_back(sm, now_ns);
+	return &sm->act;
+}
+
+/* Store a big endian header field, hdr is only as long as the header */
+static void put_field(uint8_t *hdr, size_t offset, uint16_t value) {
+	value = htons(value);
+	memcpy(hdr + offset, &value, sizeof(value));
+}
+
+int wasp2_chunk(const t_wasp2 *sm, int index, uint8_t hdr_data[WASP2_HEADER_LEN], struct iovec *iov) {
+	size_t offset = chunk_offset(sm, index);
+	size_t len = chunk_offset(sm, index + 1) - offset;
+	int firmware = (sm->download_type == DOWNLOAD_TYPE_FIRMWARE);
+	int n = 0;
+
+	memset(hdr_data, 0, WASP_HEADER_LEN);
+	put_field(hdr_data, offsetof(t_wasp_packet, packet_start), PACKET_START);
+	if(index == sm->num_chunks - 1)
+		put_field(hdr_data, offsetof(t_wasp_packet, response), CMD_START_FIRMWARE);
+	else
+		put_field(hdr_data, offsetof(t_wasp_packet, command), CMD_FIRMWARE_DATA);
+	put_field(hdr_data, offsetof(t_wasp_packet, counter), chunk_counter(index));
+
+	iov[n].iov_base = hdr_data;
+	iov[n++].iov_len = WASP_HEADER_LEN;
+	if(firmware && index == 0) {
+		iov[n].iov_base = (void *)&sm->load_addr;
+		iov[n++].iov_len = sizeof(sm->load_addr);
+	}
+	iov[n].iov_base = (void *)(sm->image->data + offset);
+	iov[n++].iov_len = len;
+	if(firmware && index == sm->num_chunks - 1) {
+		iov[n].iov_base = (void *)&sm->load_addr;
+		iov[n++].iov_len = sizeof(sm->load_addr);
+	}
+
+	return n;
+}
+
+int wasp2_num_chunks(const t_wasp2 *sm) {
+	return sm->image ? sm->num_chunks : 0;
+}
+
+const uint8_t *wasp2_acked(const t_wasp2 *sm) {
+	return sm->image ? sm->image->data + chunk_offset(sm, sm->base) : NULL;
+}
+
+void wasp2_get_stats(const t_wasp2 *sm, t_wasp2_stats *stats) {
+	*stats = sm->stats;
+}
+
+t_wasp2 *wasp2_new(const uint8_t *firmware, size_t firmware_size,
+	const uint8_t *config, size_t config_size, const t_wasp2_params *params) {
+	t_wasp2 *sm;
+
+	if(!firmware || !firmware_size)
+		return NULL;
+	sm = calloc(1, sizeof(*sm));
+	if(!sm)
+		return NULL;
+
+	sm->params = *params;
+	if(sm->params.window < 1)
+		sm->params.window = 1;
+	if(sm->params.window > WASP2_MAX_WINDOW)
+		sm->params.window = WASP2_MAX_WINDOW;
+	if(sm->params.max_chunk > WASP2_MAX_CHUNK)
+		sm->params.max_chunk = WASP2_MAX_CHUNK;
+	sm->params.max_chunk &= ~3;
+	if(sm->params.chunk_hint > sm->params.max_chunk)
+		sm->params.chunk_hint = sm->params.max_chunk;
+	/* A hint of CHUNK_SIZE means the WASP took nothing larger before */
+	if(sm->params.chunk_hint > 0 && sm->params.chunk_hint <= CHUNK_SIZE)
+		sm->params.max_chunk = 0;
+	sm->firmware.data = firmware;
+	sm->firmware.size = firmware_size;
+	if(config && config_size) {
+		sm->config.data = config;
+		sm->config.size = config_size;
+	}
+	sm->load_addr = htonl(LOAD_ADDR);
+	sm->window = 1;
+	sm->tolerant = -1;
+	sm->phase = "discovery";
+	return sm;
+}
+
+void wasp2_free(t_wasp2 *sm) {
+	free(sm);
+}
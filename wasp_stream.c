@@ -0,0 +1,412 @@
+/*
+ * Compressed stage 2 firmware images
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wasp_stream.h"
+
+/* Compressed bytes read, and uncompressed bytes produced, at once */
+#define STREAM_BLOCK		65536
+#define XZ_FOOTER_LEN		12
+#define XZ_INDEX_MAX		(1 << 20)
+
+static const uint8_t gzip_magic[] = { 0x1f, 0x8b, 0x08 };
+static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static int read_at(int fd, void *buf, size_t len, off_t offset) {
+	ssize_t n;
+
+	do {
+		n = pread(fd, buf, len, offset);
+	} while(n < 0 && errno == EINTR);
+	return n == (ssize_t)len ? 0 : -1;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* The gzip trailer ends with the uncompressed size modulo 2^32 */
+static int gzip_size(int fd, off_t file_size, size_t *size) {
+	uint8_t trailer[4];
+
+	if(file_size < 18 || read_at(fd, trailer, sizeof(trailer), file_size - 4) < 0)
+		return -1;
+	*size = get_le32(trailer);
+	return 0;
+}
+
+/*
+ * The xz stream footer points back to the index, which holds the
+ * uncompressed size. Only a single stream without padding is taken.
+ */
+static int xz_size(int fd, off_t file_size, size_t *size) {
+	uint8_t footer[XZ_FOOTER_LEN];
+	uint64_t memlimit = UINT64_MAX;
+	lzma_index *index = NULL;
+	size_t index_len, pos = 0;
+	uint8_t *buf;
+	int ret = -1;
+
+	if(file_size < 2 * XZ_FOOTER_LEN ||
+	   read_at(fd, footer, sizeof(footer), file_size - XZ_FOOTER_LEN) < 0 ||
+	   footer[10] != 'Y' || footer[11] != 'Z')
+		return -1;
+	index_len = ((size_t)get_le32(footer + 4) + 1) * 4;
+	if(index_len > XZ_INDEX_MAX || (off_t)index_len > file_size - 2 * XZ_FOOTER_LEN)
+		return -1;
+
+	buf = malloc(index_len);
+	if(!buf)
+		return -1;
+	if(read_at(fd, buf, index_len, file_size - XZ_FOOTER_LEN - index_len) == 0 &&
+	   lzma_index_buffer_decode(&index, &memlimit, NULL, buf, &pos, index_len) == LZMA_OK) {
+		*size = lzma_index_uncompressed_size(index);
+		lzma_index_end(index, NULL);
+		ret = 0;
+	}
+	free(buf);
+	return ret;
+}
+
+/*
+ * Where the producer may write next: up to room bytes at the end of
+ * what is produced, waiting while it is a window ahead. Room is 0 once
+ * the image is complete. Returns -1 if the stream is stopped.
+ */
+static int stream_room(t_stream *s, size_t *room) {
+	int stop;
+
+	pthread_mutex_lock(&s->lock);
+	while(!s->stop && s->produced < s->size && s->produced >= s->limit)
+		pthread_cond_wait(&s->cond, &s->lock);
+	*room = s->limit - s->produced;
+	if(*room > STREAM_BLOCK)
+		*room = STREAM_BLOCK;
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+	return stop ? -1 : 0;
+}
+
+static void stream_advance(t_stream *s, size_t len) {
+	if(!len)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->produced += len;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Compressed input, returns 0 at the end of the file */
+static ssize_t stream_input(t_stream *s, uint8_t *buf, off_t *pos) {
+	ssize_t n;
+
+	do {
+		n = pread(s->fd, buf, STREAM_BLOCK, *pos);
+	} while(n < 0 && errno == EINTR);
+	if(n > 0)
+		*pos += n;
+	return n;
+}
+
+/*
+ * Output past the declared size goes to a scratch buffer, so that a
+ * longer image is noticed instead of written out of bounds.
+ */
+static int inflate_gzip(t_stream *s, uint8_t *in) {
+	uint8_t scratch[16];
+	z_stream zs;
+	off_t pos = 0;
+	int eof = 0;
+	int ret = -1;
+
+	memset(&zs, 0, sizeof(zs));
+	if(inflateInit2(&zs, 15 + 16) != Z_OK)
+		return -1;
+	for(;;) {
+		size_t room, len;
+		int zret;
+
+		if(!zs.avail_in && !eof) {
+			ssize_t n = stream_input(s, in, &pos);
+
+			if(n < 0)
+				break;
+			eof = (n == 0);
+			zs.next_in = in;
+			zs.avail_in = n;
+		}
+		if(stream_room(s, &room) < 0)
+			break;
+		zs.next_out = room ? s->out + s->produced : scratch;
+		zs.avail_out = room ? room : sizeof(scratch);
+		zret = inflate(&zs, Z_NO_FLUSH);
+		len = (room ? room : sizeof(scratch)) - zs.avail_out;
+		if(!room && len)
+			break;
+		stream_advance(s, room ? len : 0);
+		if(zret == Z_STREAM_END) {
+			ret = (s->produced == s->size) ? 0 : -1;
+			break;
+		}
+		if(zret != Z_OK && !(zret == Z_BUF_ERROR && !eof))
+			break;
+	}
+	inflateEnd(&zs);
+	return ret;
+}
+
+static int inflate_xz(t_stream *s, uint8_t *in) {
+	lzma_stream xs = LZMA_STREAM_INIT;
+	uint8_t scratch[16];
+	off_t pos = 0;
+	int eof = 0;
+	int ret = -1;
+
+	if(lzma_stream_decoder(&xs, UINT64_MAX, 0) != LZMA_OK)
+		return -1;
+	for(;;) {
+		size_t room, len;
+		lzma_ret xret;
+
+		if(!xs.avail_in && !eof) {
+			ssize_t n = stream_input(s, in, &pos);
+
+			if(n < 0)
+				break;
+			eof = (n == 0);
+			xs.next_in = in;
+			xs.avail_in = n;
+		}
+		if(stream_room(s, &room) < 0)
+			break;
+		xs.next_out = room ? s->out + s->produced : scratch;
+		xs.avail_out = room ? room : sizeof(scratch);
+		xret = lzma_code(&xs, eof ? LZMA_FINISH : LZMA_RUN);
+		len = (room ? room : sizeof(scratch)) - xs.avail_out;
+		if(!room && len)
+			break;
+		stream_advance(s, room ? len : 0);
+		if(xret == LZMA_STREAM_END) {
+			ret = (s->produced == s->size) ? 0 : -1;
+			break;
+		}
+		if(xret != LZMA_OK)
+			break;
+	}
+	lzma_end(&xs);
+	return ret;
+}
+
+static void *stream_run(void *arg) {
+	t_stream *s = arg;
+	uint8_t *in = malloc(STREAM_BLOCK);
+	int ret = -1;
+
+	if(in) {
+		ret = (s->format == STREAM_GZIP) ? inflate_gzip(s, in) : inflate_xz(s, in);
+		free(in);
+	}
+	pthread_mutex_lock(&s->lock);
+	if(ret < 0 && !s->stop)
+		s->error = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static int stream_start(t_stream *s) {
+	s->produced = 0;
+	s->released = 0;
+	s->limit = (s->window && s->window < s->size) ? s->window : s->size;
+	s->stop = 0;
+	s->error = 0;
+	if(pthread_create(&s->thread, NULL, stream_run, s) != 0) {
+		fprintf(stderr, "Could not start the decompression thread.\n");
+		return -1;
+	}
+	s->running = 1;
+	return 0;
+}
+
+static void stream_stop(t_stream *s) {
+	if(!s->running)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	s->running = 0;
+}
+
+int stream_open(t_stream *s, t_image *img, const char *filename, size_t window) {
+	uint8_t magic[sizeof(xz_magic)];
+	struct stat st;
+	size_t size = 0;
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = open(filename, O_RDONLY);
+	if(s->fd < 0)
+		return 0;
+	if(fstat(s->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	   read_at(s->fd, magic, sizeof(magic), 0) < 0)
+		goto plain;
+
+	if(memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) {
+		s->format = STREAM_GZIP;
+		ret = gzip_size(s->fd, st.st_size, &size);
+	} else if(memcmp(magic, xz_magic, sizeof(xz_magic)) == 0) {
+		s->format = STREAM_XZ;
+		ret = xz_size(s->fd, st.st_size, &size);
+	} else if(memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) {
+		fprintf(stderr, "%s: zstd compressed images are not supported, use xz or gzip.\n", filename);
+		goto err;
+	} else {
+		goto plain;
+	}
+	if(ret < 0 || !size) {
+		fprintf(stderr, "%s: could not read the uncompressed size.\n", filename);
+		goto err;
+	}
+
+	/* Pages are only backed once they are written */
+	s->out = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(s->out == MAP_FAILED) {
+		perror("mmap");
+		s->out = NULL;
+		goto err;
+	}
+	s->size = size;
+	s->window = window;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if(stream_start(s) < 0) {
+		munmap(s->out, size);
+		s->out = NULL;
+		goto err;
+	}
+
+	memset(img, 0, sizeof(*img));
+	img->data = s->out;
+	img->size = size;
+	img->map = s->out;
+	return 1;
+
+plain:
+	close(s->fd);
+	s->fd = -1;
+	return 0;
+
+err:
+	close(s->fd);
+	s->fd = -1;
+	return -1;
+}
+
+/* Offset of the end of p + len in the image, 0 if it is not in there */
+static size_t stream_end(const t_stream *s, const void *p, size_t len) {
+	const uint8_t *q = p;
+
+	if(!s->out || q < s->out || q >= s->out + s->size)
+		return 0;
+	return q - s->out + len;
+}
+
+int stream_wait(t_stream *s, const void *p, size_t len) {
+	size_t end = stream_end(s, p, len);
+	int ret;
+
+	if(!end)
+		return 0;
+	pthread_mutex_lock(&s->lock);
+	if(s->produced < end && !s->error) {
+		s->waits++;
+		/* Never wait for what the window holds back */
+		if(end > s->limit) {
+			s->limit = end;
+			pthread_cond_broadcast(&s->cond);
+		}
+		while(s->produced < end && !s->error)
+			pthread_cond_wait(&s->cond, &s->lock);
+	}
+	ret = s->error ? -1 : 0;
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+int stream_ready(t_stream *s, const void *p, size_t len) {
+	size_t end = stream_end(s, p, len);
+	int ret;
+
+	if(!end)
+		return 1;
+	pthread_mutex_lock(&s->lock);
+	ret = (s->produced >= end);
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+void stream_release(t_stream *s, const void *p) {
+	long page = sysconf(_SC_PAGESIZE);
+	size_t offset, limit;
+
+	if(!s->out || !s->window || !p)
+		return;
+	if((const uint8_t *)p < s->out || (const uint8_t *)p > s->out + s->size)
+		return;
+	offset = (const uint8_t *)p - s->out;
+
+	/* Released data is needed again, decompress it once more */
+	if(offset < s->released) {
+		stream_stop(s);
+		s->restarts++;
+		if(stream_start(s) < 0)
+			s->error = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	limit = offset + s->window;
+	if(limit > s->size)
+		limit = s->size;
+	if(limit > s->limit) {
+		s->limit = limit;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	offset -= offset % page;
+	if(offset > s->released) {
+		madvise(s->out + s->released, offset - s->released, MADV_DONTNEED);
+		s->released = offset;
+	}
+}
+
+void stream_close(t_stream *s) {
+	if(!s->out)
+		return;
+	stream_stop(s);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	close(s->fd);
+	s->fd = -1;
+	/* The mapping belongs to the image now */
+	s->out = NULL;
+}
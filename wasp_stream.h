@@ -0,0 +1,74 @@
+/*
+ * Compressed stage 2 firmware images
+ *
+ * A gzip or xz compressed firmware is decompressed while it is sent.
+ * The uncompressed size comes from the container (the gzip trailer, the
+ * xz index), so the chunks are known before the first byte is inflated.
+ * A producer thread reads the compressed file in blocks and inflates it
+ * into an image sized mapping, at most window bytes ahead of what the
+ * WASP has acknowledged; acknowledged pages are handed back to the
+ * kernel. Only the compressed file is ever read, and a transfer only
+ * holds a window of the image in memory.
+ *
+ * The xz decoder holds its whole dictionary in memory, images for small
+ * hosts are best compressed with a small one, e.g. xz -1.
+ *
+ * Senders wait for the bytes of a chunk with stream_wait() before it
+ * goes out. If a chunk before released data is needed again, because
+ * the WASP restarted the download, the stream starts over.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_STREAM_H
+#define WASP_STREAM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wasp_image.h"
+
+typedef enum {
+	STREAM_NONE = 0,
+	STREAM_GZIP,
+	STREAM_XZ
+} t_stream_format;
+
+typedef struct {
+	t_stream_format format;
+	int fd;
+	uint8_t *out;
+	size_t size;
+	size_t window;			/* 0 to keep the whole image */
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Under lock */
+	size_t produced;		/* bytes ready from the start of the image */
+	size_t limit;			/* the producer stops here for now */
+	size_t released;		/* pages before this were handed back */
+	int stop;
+	int error;
+	unsigned long waits;	/* senders that had to wait for data */
+	unsigned long restarts;
+} t_stream;
+
+/*
+ * Open filename if it is compressed and start decompressing it into img.
+ * Returns 1 if it is, 0 if it is not and should be loaded as it is, -1
+ * on error.
+ */
+int stream_open(t_stream *s, t_image *img, const char *filename, size_t window);
+/* Wait until the image bytes from p on for len are ready, -1 on error */
+int stream_wait(t_stream *s, const void *p, size_t len);
+/* Like stream_wait(), but 0 instead of waiting */
+int stream_ready(t_stream *s, const void *p, size_t len);
+/* Nothing before p is needed any more, let the producer go on */
+void stream_release(t_stream *s, const void *p);
+/* Stop the producer, img is freed with image_free() afterwards */
+void stream_close(t_stream *s);
+
+#endif
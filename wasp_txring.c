@@ -0,0 +1,136 @@
+/*
+ * PACKET_TX_RING transmit ring for the AVM WASP stage 2 uploader
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+#include "wasp_txring.h"
+#include "wasp_report.h"
+
+/* Frame data starts right behind the aligned tpacket3_hdr */
+#define TXRING_DATA_OFFSET	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+static struct tpacket3_hdr *txring_hdr(t_txring *ring, unsigned int slot) {
+	return (struct tpacket3_hdr *)(ring->map + (size_t)slot * ring->frame_size);
+}
+
+int txring_open(t_txring *ring, int ifindex, unsigned int frames) {
+	struct sockaddr_ll addr;
+	struct tpacket_req3 req;
+	int version = TPACKET_V3;
+	unsigned int block_size = getpagesize();
+	unsigned int per_block;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	if(block_size < TXRING_FRAME_SIZE)
+		block_size = TXRING_FRAME_SIZE;
+	per_block = block_size / TXRING_FRAME_SIZE;
+	frames = (frames + per_block - 1) / per_block * per_block;
+
+	/* Protocol 0: the socket never receives anything */
+	ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if(ring->fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = ifindex;
+	if(bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		goto err;
+	}
+
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("PACKET_VERSION");
+		goto err;
+	}
+
+	/* Retire timeout, private area and features must be zero for TX */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = block_size;
+	req.tp_block_nr = frames / per_block;
+	req.tp_frame_size = TXRING_FRAME_SIZE;
+	req.tp_frame_nr = frames;
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		perror("PACKET_TX_RING");
+		goto err;
+	}
+
+	ring->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if(ring->map == MAP_FAILED) {
+		perror("mmap");
+		ring->map = NULL;
+		goto err;
+	}
+	ring->frames = frames;
+	ring->frame_size = TXRING_FRAME_SIZE;
+	return 0;
+
+err:
+	txring_close(ring);
+	return -1;
+}
+
+/* Copy a frame into a free slot, fails if the kernel still owns it */
+int txring_fill(t_txring *ring, unsigned int slot, const struct iovec *iov, int iovcnt) {
+	struct tpacket3_hdr *hdr = txring_hdr(ring, slot);
+	uint8_t *p = (uint8_t *)hdr + TXRING_DATA_OFFSET;
+	size_t len = 0;
+	int i;
+
+	if(hdr->tp_status != TP_STATUS_AVAILABLE)
+		return -1;
+
+	for(i = 0; i < iovcnt; i++) {
+		if(len + iov[i].iov_len > ring->frame_size - TXRING_DATA_OFFSET)
+			return -1;
+		memcpy(p + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	hdr->tp_next_offset = 0;
+	hdr->tp_len = len;
+	return 0;
+}
+
+/*
+ * Hand the slot at the head to the kernel and transmit it. The send is
+ * blocking, so the slot is free again once this returns.
+ */
+int txring_send(t_txring *ring, unsigned int slot) {
+	struct tpacket3_hdr *hdr = txring_hdr(ring, slot);
+
+	if(slot != ring->head || hdr->tp_status != TP_STATUS_AVAILABLE)
+		return -1;
+
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+	report_syscall(REPORT_SYS_SEND);
+	if(send(ring->fd, NULL, 0, 0) < 0) {
+		perror("send");
+		return -1;
+	}
+	ring->head = (ring->head + 1) % ring->frames;
+	ring->sent++;
+	return 0;
+}
+
+void txring_close(t_txring *ring) {
+	if(ring->map)
+		munmap(ring->map, ring->map_len);
+	if(ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
@@ -0,0 +1,43 @@
+/*
+ * PACKET_TX_RING transmit ring for the AVM WASP stage 2 uploader
+ *
+ * Frames are written into a TPACKET_V3 ring shared with the kernel ahead
+ * of time. Sending one is then a matter of flipping its status and a
+ * single send() without any copy on the critical path. The kernel walks
+ * the ring strictly in order, so frames have to be queued in slot order
+ * starting at the head.
+ *
+ * The ring lives on its own transmit-only socket: once a socket has a
+ * TX ring, every send on it goes through the ring, which would get in
+ * the way of plain sendmsg() retransmissions.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_TXRING_H
+#define WASP_TXRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define TXRING_FRAMES		64
+#define TXRING_FRAME_SIZE	2048
+
+typedef struct {
+	int fd;
+	uint8_t *map;
+	size_t map_len;
+	unsigned int frames;
+	unsigned int frame_size;
+	unsigned int head;		/* next slot the kernel will transmit */
+	unsigned long sent;
+} t_txring;
+
+int txring_open(t_txring *ring, int ifindex, unsigned int frames);
+int txring_fill(t_txring *ring, unsigned int slot, const struct iovec *iov, int iovcnt);
+int txring_send(t_txring *ring, unsigned int slot);
+void txring_close(t_txring *ring);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Combined stage 1 and stage 2 firmware uploader for AVM WASP
+ *
+ * Stage 2 is prepared on a second thread while stage 1 is uploaded:
+ * the images are loaded and the socket is opened, filtered and bound
+ * before the stage 1 firmware boots, so its first discovery frame is
+ * already queued when stage 1 is done and stage 2 takes over.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "wasp_capture.h"
+#include "wasp_report.h"
+#include "wasp_stage1_upload.h"
+#include "wasp_stage2_upload.h"
+
+static t_stage1_options m_stage1;
+static t_stage2_options m_stage2;
+static t_report m_report;
+static t_capture *m_capture1;
+static t_capture *m_capture2;
+static int m_prepare_ret;
+
+static char *progname;
+static char *opt_report;
+static char *opt_capture1;
+static char *opt_capture2;
+
+static void write_report(void) {
+	report_write(&m_report, opt_report);
+}
+
+static void close_captures(void) {
+	capture_close(m_capture1);
+	capture_close(m_capture2);
+}
+
+static void *prepare_stage2(void *arg) {
+	(void)arg;
+	m_prepare_ret = stage2_prepare(&m_stage2);
+	return NULL;
+}
+
+static int check_options(void) {
+	if(!m_stage2.filename) {
+		fprintf(stderr, "No stage 2 firmware specified.\n");
+		return -1;
+	}
+
+	if(!m_stage2.iface)
+		m_stage2.iface = m_stage1.iface;
+	if(!m_stage2.iface) {
+		fprintf(stderr, "No stage 2 interface specified.\n");
+		return -1;
+	}
+
+	if(m_stage1.compile_only) {
+		fprintf(stderr, "Use wasp_uploader_stage1 to compile a plan.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(int status)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS...]\n", progname);
+	fprintf(stderr,
+"\n"
+"Stage 1 options:\n"
+"  -m <model>      use the specified FRITZ!Box Model (3390, 3490)\n"
+"  -i <interface>  use the specified Ethernet interface\n"
+"  -f <file>       upload the specified stage 1 firmware file\n"
+"  -P <plan>       use the specified upload plan cache, see\n"
+"                  wasp_uploader_stage1\n"
+"  -t <transport>  MDIO transport: ioctl (default) or\n"
+"                  sim[,latency=<us>][,turnaround=<us>][,boot=<us>][,rounds=<n>]\n"
+"  -p <mode>       completion polling: fixed (default) or adaptive\n"
+"  -n              always write all data registers (no shadow cache)\n"
+"  -b              submit every register write on its own\n"
+"  -L              run the boot handshake with realtime priority and\n"
+"                  locked memory (needs root)\n"
+"  -o <file>       capture all register accesses to this pcapng file\n"
+"\n"
+"Stage 2 options:\n"
+"  -I <interface>  use the specified Ethernet interface (default: -i)\n"
+"  -F <file>       upload the specified stage 2 firmware file, which may\n"
+"                  be gzip or xz compressed\n"
+"  -c <file>       upload the optional config file, or a directory that\n"
+"                  is packed into a tar.gz on the fly\n"
+"  -k <file>       cache the archive packed from a config directory in\n"
+"                  this file and reuse it while the directory is unchanged\n"
+"  -a <ms>         retransmit a packet if it is not acknowledged within\n"
+"                  this time (default: 100)\n"
+"  -r <count>      give up after this many retransmissions of a packet\n"
+"                  (default: 5)\n"
+"  -T <seconds>    give up if the WASP does not ask for stage 2 within\n"
+"                  this time, or the transfer takes longer once it has\n"
+"                  (default: 60, 0 to wait forever)\n"
+"  -R              prebuild frames in a PACKET_TX_RING and send them\n"
+"                  from there\n"
+"  -w <frames>     keep up to this many frames in flight once the WASP\n"
+"                  has been probed to accept them (default: 1, max: 64)\n"
+"  -s              strict ACK matching from the first frame on\n"
+"  -M              negotiate chunks larger than 1024 bytes, up to what\n"
+"                  fits into the interface MTU\n"
+"  -K <file>       cache the negotiated chunk size per model (-m) in this\n"
+"                  file and only try that size on later uploads\n"
+"  -x              put the interface into promiscuous mode while running\n"
+"  -O <file>       capture all frames sent and received to this pcapng file\n"
+"\n"
+"Common options:\n"
+"  -j <file>       write a JSON report with timing and system calls per\n"
+"                  upload phase of both stages to this file (- for stdout)\n"
+"  -v              verbose output\n"
+"  -h              show this screen\n"
+	);
+
+	exit(status);
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t thread;
+	progname = basename(argv[0]);
+	int ret = EXIT_FAILURE;
+
+	stage2_default_options(&m_stage2);
+
+	while(1) {
+		int c;
+
+		c = getopt(argc, argv, "m:i:f:P:t:p:nbLo:I:F:c:k:a:r:T:Rw:sMK:xO:j:hv");
+		if(c == -1)
+			break;
+
+		switch(c) {
+
+		case 'm':
+			m_stage1.model = optarg;
+			break;
+
+		case 'i':
+			m_stage1.iface = optarg;
+			break;
+
+		case 'f':
+			m_stage1.filename = optarg;
+			break;
+
+		case 'P':
+			m_stage1.plan = optarg;
+			break;
+
+		case 't':
+			m_stage1.transport = optarg;
+			break;
+
+		case 'p':
+			m_stage1.poll = optarg;
+			break;
+
+		case 'n':
+			m_stage1.no_shadow = 1;
+			break;
+
+		case 'b':
+			m_stage1.no_batch = 1;
+			break;
+
+		case 'L':
+			m_stage1.realtime = 1;
+			break;
+
+		case 'o':
+			opt_capture1 = optarg;
+			break;
+
+		case 'I':
+			m_stage2.iface = optarg;
+			break;
+
+		case 'F':
+			m_stage2.filename = optarg;
+			break;
+
+		case 'c':
+			m_stage2.config = optarg;
+			break;
+
+		case 'k':
+			m_stage2.config_cache = optarg;
+			break;
+
+		case 'a':
+			m_stage2.ack_timeout = atoi(optarg);
+			break;
+
+		case 'r':
+			m_stage2.retries = atoi(optarg);
+			break;
+
+		case 'T':
+			m_stage2.total_timeout = atoi(optarg);
+			break;
+
+		case 'R':
+			m_stage2.tx_ring = 1;
+			break;
+
+		case 'w':
+			m_stage2.window = atoi(optarg);
+			break;
+
+		case 's':
+			m_stage2.strict = 1;
+			break;
+
+		case 'M':
+			m_stage2.negotiate = 1;
+			break;
+
+		case 'K':
+			m_stage2.chunk_cache = optarg;
+			break;
+
+		case 'x':
+			m_stage2.promisc = 1;
+			break;
+
+		case 'O':
+			opt_capture2 = optarg;
+			break;
+
+		case 'j':
+			opt_report = optarg;
+			break;
+
+		case 'v':
+			m_stage1.verbose = 1;
+			m_stage2.verbose = 1;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	m_stage1.report = &m_report;
+	m_stage2.report = &m_report;
+	m_stage2.model = m_stage1.model;
+	if(stage1_init(&m_stage1) || check_options())
+		return EXIT_FAILURE;
+
+	printf("AVM WASP uploader.\n");
+
+	if(m_stage1.filename)
+		printf("Stage 1 file   : %s\n", m_stage1.filename);
+	if(m_stage1.plan)
+		printf("Stage 1 plan   : %s\n", m_stage1.plan);
+	if(m_stage1.iface)
+		printf("Stage 1 device : %s\n", m_stage1.iface);
+	printf("Stage 2 file   : %s\n", m_stage2.filename);
+	printf("Stage 2 device : %s\n", m_stage2.iface);
+	if(m_stage2.config)
+		printf("Stage 2 config : %s\n", m_stage2.config);
+
+	/* The report and the captures are written on every exit path */
+	report_init(&m_report, "wasp_uploader", opt_report != NULL);
+	if(opt_report)
+		atexit(write_report);
+	if(opt_capture1) {
+		m_capture1 = capture_open(opt_capture1, CAPTURE_LINKTYPE_MDIO);
+		if(!m_capture1)
+			return EXIT_FAILURE;
+	}
+	if(opt_capture2) {
+		m_capture2 = capture_open(opt_capture2, CAPTURE_LINKTYPE_ETHERNET);
+		if(!m_capture2) {
+			capture_close(m_capture1);
+			return EXIT_FAILURE;
+		}
+	}
+	atexit(close_captures);
+	m_stage1.capture = m_capture1;
+	m_stage2.capture = m_capture2;
+
+	/* Stage 2 does not touch the WASP until stage 1 is done */
+	if(pthread_create(&thread, NULL, prepare_stage2, NULL) != 0) {
+		fprintf(stderr, "Could not start the stage 2 thread, preparing it afterwards.\n");
+		ret = stage1_upload();
+		if(ret)
+			return ret;
+		prepare_stage2(NULL);
+	} else {
+		ret = stage1_upload();
+		pthread_join(thread, NULL);
+		if(ret) {
+			stage2_close();
+			return ret;
+		}
+	}
+
+	if(m_prepare_ret < 0) {
+		fprintf(stderr, "Could not prepare stage 2.\n");
+		return EXIT_FAILURE;
+	}
+
+	ret = stage2_run();
+	stage2_close();
+
+	return ret;
+}
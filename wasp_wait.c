@@ -0,0 +1,91 @@
+/*
+ * Deadline waits for the AVM WASP stage 1 uploader
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "wasp_mdio.h"
+#include "wasp_report.h"
+#include "wasp_wait.h"
+
+#define WAIT_RT_PRIORITY	50
+
+void wait_init(t_wait *wait, int realtime) {
+	memset(wait, 0, sizeof(*wait));
+	wait->realtime = realtime;
+}
+
+int wait_lock_memory(void) {
+	if(mlockall(MCL_CURRENT) < 0) {
+		perror("mlockall");
+		return -1;
+	}
+	return 0;
+}
+
+void wait_unlock_memory(void) {
+	munlockall();
+}
+
+void wait_until(t_wait *wait, uint64_t deadline) {
+	struct timespec ts;
+	uint64_t now = mdio_now_ns();
+
+	if(deadline <= now)
+		return;
+	ts.tv_sec = deadline / 1000000000ull;
+	ts.tv_nsec = deadline % 1000000000ull;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	report_syscall(REPORT_SYS_NANOSLEEP);
+
+	now = mdio_now_ns();
+	wait->sleeps++;
+	if(now > deadline) {
+		wait->late_sum_ns += now - deadline;
+		if(now - deadline > wait->late_max_ns)
+			wait->late_max_ns = now - deadline;
+	}
+}
+
+void wait_begin(t_wait *wait) {
+	struct sched_param param = { .sched_priority = WAIT_RT_PRIORITY };
+	int err;
+
+	if(wait->active)
+		return;
+	wait->active = 1;
+	/* The default 50us timer slack is in the range of the deadlines */
+	wait->old_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	if(!wait->realtime)
+		return;
+	pthread_getschedparam(pthread_self(), &wait->old_policy, &wait->old_param);
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if(err) {
+		fprintf(stderr, "Could not switch to realtime priority: %s\n", strerror(err));
+		wait->realtime = 0;
+		return;
+	}
+	wait->rt_active = 1;
+}
+
+void wait_end(t_wait *wait) {
+	if(!wait->active)
+		return;
+	if(wait->old_slack > 0)
+		prctl(PR_SET_TIMERSLACK, (unsigned long)wait->old_slack, 0, 0, 0);
+	if(wait->rt_active)
+		pthread_setschedparam(pthread_self(), wait->old_policy, &wait->old_param);
+	wait->rt_active = 0;
+	wait->active = 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Deadline waits for the AVM WASP stage 1 uploader
+ *
+ * The boot handshake reads the status register on absolute deadlines
+ * from the state machine, a few hundred microseconds apart. A wait
+ * sleeps with clock_nanosleep() on CLOCK_MONOTONIC until the deadline,
+ * so it neither drifts nor depends on the time spent in between, and
+ * records how late it woke up.
+ *
+ * In realtime mode the handshake runs with SCHED_FIFO priority and the
+ * process memory is locked during stage 1, so that a wakeup is not
+ * delayed by other tasks or page faults. Both need CAP_SYS_NICE and
+ * CAP_IPC_LOCK or the matching rlimits, without them the waits fall
+ * back to normal scheduling with a warning.
+ *
+ * (c) 2019-2020 Andreas Böhler
+ * GPLv2
+ */
+
+#ifndef WASP_WAIT_H
+#define WASP_WAIT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct {
+	int realtime;
+	int active;
+	int rt_active;
+	int old_slack;
+	int old_policy;
+	struct sched_param old_param;
+	unsigned long sleeps;
+	uint64_t late_sum_ns;
+	uint64_t late_max_ns;
+} t_wait;
+
+void wait_init(t_wait *wait, int realtime);
+/*
+ * Lock what is mapped now once, before any realtime wait, and unlock it
+ * when stage 1 is over. Later mappings, like the stage 2 image, are not
+ * locked.
+ */
+int wait_lock_memory(void);
+void wait_unlock_memory(void);
+void wait_until(t_wait *wait, uint64_t deadline);
+/*
+ * Prepare the calling thread for deadline waits and restore it again:
+ * minimal timer slack, and realtime priority if enabled
+ */
+void wait_begin(t_wait *wait);
+void wait_end(t_wait *wait);
+
+#endif